@@ -0,0 +1,218 @@
+// This software is Copyright (C) 2023-2024 by James C. Ahlstrom.
+// This free software is licensed for use under the GNU General Public
+// License (GPL), see http://www.opensource.org.
+// Note that there is NO WARRANTY AT ALL.  USE AT YOUR OWN RISK!!
+
+// This is the optional kernel fast path for hl2_wifi_buffer. It is a TC eBPF program loaded by
+// hl2_wifi_buffer when bpf_fast_path is set. Make it with "make hl2_wifi_buffer_bpf".
+//
+// hl2_ingress runs on the HL2 interface. Each HL2 packet for port 1024 is copied to the client with
+// new addresses. The original packet is still passed to hl2_wifi_buffer, because the HL2 packets
+// time the Tx samples, but it is marked so the program does not send it again.
+//
+// wifi_ingress runs on the WiFi interface. In pass-through mode (buffer_milliseconds = 0) each Tx
+// packet from the client gets a new sequence number and new addresses, and is sent to the HL2 by
+// the kernel. In buffered mode it passes the packet to hl2_wifi_buffer.
+//
+// All other packets, such as discover and start, are passed to hl2_wifi_buffer unchanged.
+//
+// The MAC addresses are learned from the packets, so the HL2 and the client must be on the
+// networks of the two interfaces (or the client behind a router on the WiFi network).
+
+#include <linux/bpf.h>
+#include <linux/pkt_cls.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include "hl2_bpf.h"
+
+#define AF_INET		2
+#define HL2_BYTES	1032	// UDP data bytes in an HL2 packet
+#define HL2_FRAME	(sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) + HL2_BYTES)
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__uint(max_entries, 1);
+	__uint(map_flags, BPF_F_MMAPABLE);	// hl2_wifi_buffer writes the configuration directly
+	__type(key, __u32);
+	__type(value, struct hl2_bpf_config);
+} hl2_config SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__uint(max_entries, HL2_BPF_STATS);
+	__type(key, __u32);
+	__type(value, __u64);
+} hl2_stats SEC(".maps");
+
+struct packet {
+	struct ethhdr * eth;
+	struct iphdr * ip;
+	struct udphdr * udp;
+	__u8 * data;
+};
+
+static __always_inline void count(__u32 index)
+{
+	__u64 * value = bpf_map_lookup_elem(&hl2_stats, &index);
+
+	if (value)
+		*value += 1;
+}
+
+static __always_inline int parse(struct __sk_buff * skb, struct packet * pkt)
+// Return 1 if this is an IPv4 UDP packet with HL2_BYTES of data. The packet must be pulled first.
+{
+	void * data = (void *)(long)skb->data;
+	void * end = (void *)(long)skb->data_end;
+
+	if (data + HL2_FRAME > end)
+		return 0;
+	pkt->eth = data;
+	pkt->ip = (void *)(pkt->eth + 1);
+	pkt->udp = (void *)(pkt->ip + 1);
+	pkt->data = (void *)(pkt->udp + 1);
+	if (pkt->eth->h_proto != bpf_htons(ETH_P_IP) || pkt->ip->ihl != 5 || pkt->ip->protocol != IPPROTO_UDP)
+		return 0;
+	if (pkt->udp->len != bpf_htons(sizeof(struct udphdr) + HL2_BYTES))
+		return 0;
+	return pkt->data[0] == 0xEF && pkt->data[1] == 0xFE && pkt->data[2] == 0x01;
+}
+
+static __always_inline __u16 ip_checksum(struct iphdr * ip)
+{
+	__u16 * pt = (__u16 *)ip;
+	__u32 sum = 0;
+	int i;
+
+	ip->check = 0;
+#pragma unroll
+	for (i = 0; i < (int)sizeof(struct iphdr) / 2; i++)
+		sum += pt[i];
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return ~sum;
+}
+
+static __always_inline int same_mac(__u8 * a, __u8 * b)
+{
+	int i;
+
+#pragma unroll
+	for (i = 0; i < ETH_ALEN; i++)
+		if (a[i] != b[i])
+			return 0;
+	return 1;
+}
+
+static __always_inline void learn(struct hl2_bpf_config * cfg, struct ethhdr * eth, __u8 * mac, __u8 * host_mac, __u32 flag)
+// Record the MAC addresses of a packet from the HL2 or the client. Write only when they change.
+{
+	if ((cfg->macs & flag) && same_mac(mac, eth->h_source) && same_mac(host_mac, eth->h_dest))
+		return;
+	__sync_fetch_and_and(&cfg->macs, ~flag);
+	__builtin_memcpy(mac, eth->h_source, ETH_ALEN);
+	__builtin_memcpy(host_mac, eth->h_dest, ETH_ALEN);
+	__sync_fetch_and_or(&cfg->macs, flag);
+}
+
+static __always_inline void readdress(struct packet * pkt, __u8 * dmac, __u8 * smac,
+		__u32 saddr, __u16 sport, __u32 daddr, __u16 dport)
+{
+	__builtin_memcpy(pkt->eth->h_dest, dmac, ETH_ALEN);
+	__builtin_memcpy(pkt->eth->h_source, smac, ETH_ALEN);
+	pkt->ip->saddr = saddr;
+	pkt->ip->daddr = daddr;
+	pkt->ip->ttl = 64;
+	pkt->ip->check = ip_checksum(pkt->ip);
+	pkt->udp->source = sport;
+	pkt->udp->dest = dport;
+	pkt->udp->check = 0;		// no UDP checksum, the same as the HL2
+}
+
+SEC("tc")
+int hl2_ingress(struct __sk_buff * skb)
+{
+	__u32 key = 0;
+	struct hl2_bpf_config * cfg = bpf_map_lookup_elem(&hl2_config, &key);
+	struct packet pkt;
+	struct ethhdr eth;
+	__u32 saddr, daddr;
+	__u16 sport, dport;
+	__u8 ttl;
+
+	if ( ! cfg || ! (cfg->enable & HL2_BPF_DOWNLINK))
+		return TC_ACT_OK;
+	if (bpf_skb_pull_data(skb, HL2_FRAME) != 0 || ! parse(skb, &pkt))
+		return TC_ACT_OK;
+	if (pkt.data[3] != 0x06 || pkt.ip->saddr != cfg->hl2_addr || pkt.udp->source != bpf_htons(1024))
+		return TC_ACT_OK;
+	learn(cfg, pkt.eth, cfg->hl2_mac, cfg->hl2_host_mac, HL2_BPF_HL2_MAC);
+	if ( ! (cfg->macs & HL2_BPF_CLIENT_MAC)) {
+		count(HL2_BPF_STAT_NO_MAC);
+		return TC_ACT_OK;
+	}
+	eth = *pkt.eth;
+	saddr = pkt.ip->saddr;
+	daddr = pkt.ip->daddr;
+	sport = pkt.udp->source;
+	dport = pkt.udp->dest;
+	ttl = pkt.ip->ttl;
+	readdress(&pkt, cfg->client_mac, cfg->wifi_host_mac, cfg->wifi_host, bpf_htons(1024), cfg->client_addr, cfg->client_port);
+	if (bpf_clone_redirect(skb, cfg->wifi_ifindex, 0) != 0) {
+		count(HL2_BPF_STAT_NO_MAC);
+		return TC_ACT_SHOT;	// the headers were changed; the program will see a missing packet
+	}
+	count(HL2_BPF_STAT_DOWNLINK);
+	// Restore the original packet for hl2_wifi_buffer, and mark it as sent.
+	if ( ! parse(skb, &pkt))
+		return TC_ACT_SHOT;
+	*pkt.eth = eth;
+	pkt.ip->saddr = saddr;
+	pkt.ip->daddr = daddr;
+	pkt.ip->ttl = ttl;
+	pkt.ip->check = ip_checksum(pkt.ip);
+	pkt.udp->source = sport;
+	pkt.udp->dest = dport;
+	pkt.udp->check = 0;
+	pkt.data[2] |= HL2_BPF_FORWARDED;
+	return TC_ACT_OK;
+}
+
+SEC("tc")
+int wifi_ingress(struct __sk_buff * skb)
+{
+	__u32 key = 0;
+	struct hl2_bpf_config * cfg = bpf_map_lookup_elem(&hl2_config, &key);
+	struct packet pkt;
+	__u32 seq;
+
+	if ( ! cfg || ! cfg->enable)	// the client MAC is needed for either direction
+		return TC_ACT_OK;
+	if (bpf_skb_pull_data(skb, HL2_FRAME) != 0 || ! parse(skb, &pkt))
+		return TC_ACT_OK;
+	if (pkt.data[3] != 0x02 || pkt.ip->saddr != cfg->client_addr || pkt.udp->source != cfg->client_port ||
+			pkt.ip->daddr != cfg->wifi_host || pkt.udp->dest != bpf_htons(1024))	// only the primary client
+		return TC_ACT_OK;
+	learn(cfg, pkt.eth, cfg->client_mac, cfg->wifi_host_mac, HL2_BPF_CLIENT_MAC);
+	if ( ! (cfg->enable & HL2_BPF_UPLINK))
+		return TC_ACT_OK;
+	if ( ! (cfg->macs & HL2_BPF_HL2_MAC)) {
+		count(HL2_BPF_STAT_NO_MAC);
+		return TC_ACT_OK;
+	}
+	seq = __sync_fetch_and_add(&cfg->hl2_sequence, 1);	// regenerate sequence numbers sent to the HL2
+	pkt.data[4] = seq >> 24 & 0xFF;
+	pkt.data[5] = seq >> 16 & 0xFF;
+	pkt.data[6] = seq >>  8 & 0xFF;
+	pkt.data[7] = seq       & 0xFF;
+	readdress(&pkt, cfg->hl2_mac, cfg->hl2_host_mac, cfg->hl2_host, cfg->hl2_host_port, cfg->hl2_addr, bpf_htons(1024));
+	count(HL2_BPF_STAT_UPLINK);
+	cfg->client_time = bpf_ktime_get_ns();		// the program does not see this packet
+	return bpf_redirect(cfg->hl2_ifindex, 0);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,47 @@
+// This software is Copyright (C) 2023-2024 by James C. Ahlstrom.
+// This free software is licensed for use under the GNU General Public
+// License (GPL), see http://www.opensource.org.
+// Note that there is NO WARRANTY AT ALL.  USE AT YOUR OWN RISK!!
+
+// Definitions shared by hl2_wifi_buffer.c and the kernel fast path in hl2_bpf.bpf.c.
+
+#ifndef HL2_BPF_H
+#define HL2_BPF_H
+
+#include <linux/types.h>
+
+#define HL2_BPF_OBJECT		"hl2_bpf.bpf.o"
+#define HL2_BPF_DOWNLINK	0x01	// the kernel copies HL2 packets to the client
+#define HL2_BPF_UPLINK		0x02	// the kernel copies client Tx packets to the HL2; pass-through mode only
+#define HL2_BPF_FORWARDED	0x80	// set in byte 2 of an HL2 packet that the kernel already sent to the client
+#define HL2_BPF_HL2_MAC		0x01	// the HL2 MAC addresses are known
+#define HL2_BPF_CLIENT_MAC	0x02	// the client MAC addresses are known
+
+enum {		// index into the hl2_stats map
+	HL2_BPF_STAT_DOWNLINK,		// HL2 packets sent to the client by the kernel
+	HL2_BPF_STAT_UPLINK,		// client packets sent to the HL2 by the kernel
+	HL2_BPF_STAT_NO_MAC,		// packets passed to the program because the next MAC address was not known yet
+	HL2_BPF_STATS
+};
+
+struct hl2_bpf_config {		// the single entry in the hl2_config map; addresses and ports are in network order
+	__u32 enable;		// HL2_BPF_DOWNLINK and HL2_BPF_UPLINK
+	__u32 hl2_sequence;	// sequence number for packets to the HL2, shared with the program
+	__u32 hl2_ifindex;
+	__u32 wifi_ifindex;
+	__u32 hl2_addr;		// the HL2
+	__u32 hl2_host;		// our address on the HL2 interface
+	__u32 wifi_host;	// our address on the WiFi interface
+	__u32 client_addr;	// the PC
+	__u16 client_port;
+	__u16 hl2_host_port;	// our port on the HL2 interface
+	// The kernel learns the MAC addresses from received packets, so IP forwarding is not needed.
+	__u32 macs;		// HL2_BPF_HL2_MAC and HL2_BPF_CLIENT_MAC
+	__u8 hl2_mac[6];	// the HL2
+	__u8 hl2_host_mac[6];	// our HL2 interface
+	__u8 client_mac[6];	// the PC, or the router to the PC
+	__u8 wifi_host_mac[6];	// our WiFi interface
+	__u64 client_time;	// bpf_ktime_get_ns() of the last Tx packet sent to the HL2 by the kernel
+};
+
+#endif
@@ -0,0 +1,94 @@
+#!/bin/sh
+# This software is Copyright (C) 2023-2024 by James C. Ahlstrom.
+# This free software is licensed for use under the GNU General Public
+# License (GPL), see http://www.opensource.org.
+# Note that there is NO WARRANTY AT ALL.  USE AT YOUR OWN RISK!!
+
+# Test hl2_wifi_buffer without hardware, and compare the kernel fast path with the normal program.
+# The SBC, the HL2 and the PC are network namespaces joined by veth pairs. The HL2 and the PC are
+# hl2_test_peer.py. Make the program with "make hl2_wifi_buffer_bpf" first, and run this as root:
+#   sudo ./hl2_bpf_test.sh [seconds] [hl2_packets_per_second]
+# Each run prints the loss and delay seen by the PC and the HL2, and the CPU time used by hl2_wifi_buffer
+# and by the whole system. The default of 3048 packets per second is the HL2 at 384 ksps.
+
+SECS=${1:-20}
+RATE=${2:-3048}
+DIR=$(cd $(dirname $0) && pwd)
+PROGRAM=${PROGRAM:-$DIR/hl2_wifi_buffer}
+OBJECT=${OBJECT:-$DIR/hl2_bpf.bpf.o}
+WORK=$(mktemp -d)
+
+cleanup() {
+	ip netns pids hl2t-sbc 2>/dev/null | xargs -r kill 2>/dev/null
+	ip netns pids hl2t-hl2 2>/dev/null | xargs -r kill 2>/dev/null
+	ip netns pids hl2t-pc 2>/dev/null | xargs -r kill 2>/dev/null
+	sleep 0.5
+	ip netns del hl2t-sbc 2>/dev/null
+	ip netns del hl2t-hl2 2>/dev/null
+	ip netns del hl2t-pc 2>/dev/null
+	rm -rf $WORK
+}
+
+cpu_ticks() {	# user + system ticks of a process, or of the whole system
+	if [ -n "$1" ]; then
+		awk '{print $14 + $15}' /proc/$1/stat
+	else
+		awk '/^cpu / {print $2 + $3 + $4 + $7 + $8}' /proc/stat
+	fi
+}
+
+setup() {
+	ip netns add hl2t-sbc
+	ip netns add hl2t-hl2
+	ip netns add hl2t-pc
+	ip link add eth0 netns hl2t-sbc type veth peer name eth0 netns hl2t-hl2
+	ip link add wlan0 netns hl2t-sbc type veth peer name wlan0 netns hl2t-pc
+	ip -n hl2t-sbc addr add 169.254.1.1/16 dev eth0
+	ip -n hl2t-hl2 addr add 169.254.19.221/16 dev eth0
+	ip -n hl2t-sbc addr add 192.168.77.1/24 dev wlan0
+	ip -n hl2t-pc addr add 192.168.77.2/24 dev wlan0
+	for ns in hl2t-sbc hl2t-hl2 hl2t-pc; do
+		ip -n $ns link set lo up
+		ip -n $ns link set eth0 up 2>/dev/null
+		ip -n $ns link set wlan0 up 2>/dev/null
+	done
+	cp $PROGRAM $WORK/hl2_wifi_buffer
+	[ -f $OBJECT ] && cp $OBJECT $WORK/
+}
+
+run() {		# run buffer_milliseconds bpf_fast_path
+	printf "hl2_interface = eth0\nwifi_interface = wlan0\nbuffer_milliseconds = %s\nbpf_fast_path = %s\n" $1 $2 > $WORK/hl2_wifi_buffer.txt
+	(cd $WORK && exec ip netns exec hl2t-sbc ./hl2_wifi_buffer > $WORK/program.log 2>&1) &
+	sleep 1
+	PID=$(ip netns pids hl2t-sbc | head -1)
+	ip netns exec hl2t-hl2 python3 $DIR/hl2_test_peer.py hl2 $RATE > $WORK/hl2.log 2>&1 &
+	sleep 0.5
+	T0=$(cpu_ticks $PID)
+	S0=$(cpu_ticks)
+	ip netns exec hl2t-pc python3 $DIR/hl2_test_peer.py pc 192.168.77.1 $SECS > $WORK/pc.log 2>&1
+	T1=$(cpu_ticks $PID)
+	S1=$(cpu_ticks)
+	sleep 0.5
+	STATUS=$(ip netns exec hl2t-pc python3 -c "import urllib.request; print(urllib.request.urlopen('http://192.168.77.1:8080', timeout=2).read().decode())" 2>/dev/null |
+		sed -n 's/<[^>]*>//g; /Kernel fast path/p')
+	ip netns pids hl2t-hl2 | xargs -r kill
+	kill $PID
+	wait 2>/dev/null
+	echo "buffer_milliseconds $1, bpf_fast_path $2:"
+	sed 's/^/    /' $WORK/pc.log $WORK/hl2.log
+	[ -n "$STATUS" ] && echo "    $STATUS"
+	sed "s/^/    /" $WORK/program.log
+	awk -v t=$((T1 - T0)) -v s=$((S1 - S0)) -v secs=$SECS -v hz=$(getconf CLK_TCK) \
+		'BEGIN {printf "    CPU: hl2_wifi_buffer %.1f%%, whole system %.1f%%\n", t * 100 / hz / secs, s * 100 / hz / secs}'
+}
+
+if [ $(id -u) != 0 ]; then
+	echo "Run this as root"
+	exit 1
+fi
+trap cleanup EXIT INT TERM
+setup
+for delay in 300 0; do
+	run $delay 0
+	run $delay 1
+done
@@ -0,0 +1,336 @@
+// This software is Copyright (C) 2023-2024 by James C. Ahlstrom.
+// This free software is licensed for use under the GNU General Public
+// License (GPL), see http://www.opensource.org.
+// Note that there is NO WARRANTY AT ALL.  USE AT YOUR OWN RISK!!
+
+// This program replays a recording of Tx packet arrival times through the Tx buffer code in txbuf.c
+// that hl2_wifi_buffer uses. It runs in virtual time, so a long recording takes only a few seconds.
+// It tries several buffer delays and reports underflows, overflows, missing packets and the
+// time that packets stay in the buffer. Use it to choose buffer_milliseconds for your site.
+//
+// Usage: hl2_buffer_sim [-k keydown_milliseconds] trace_file [buffer_milliseconds ...]
+//
+// The trace_file is either a file recorded by hl2_wifi_buffer (see trace_file in hl2_wifi_buffer.txt),
+// or a pcap or pcapng file captured with tcpdump or Wireshark on the SBC WiFi interface.
+
+#include <stdlib.h>
+#include <string.h>
+#include "txbuf.h"
+
+#define SIM_RESIDENCY_BINS	(TX_DELAY_MAX * 4)	// histogram of residency in milliseconds
+#define PCAPNG_IFACES		16			// interfaces in one pcapng section
+
+struct s_arrival {
+	double time;
+	uint32_t sequence;
+	uint8_t mox;
+};
+
+static struct s_arrival * Arrivals = NULL;
+static int num_arrivals = 0;
+static unsigned int residency_hist[SIM_RESIDENCY_BINS];
+
+static void add_arrival(double time, uint32_t sequence, int mox)
+{
+	static int size = 0;
+
+	if (num_arrivals >= size) {
+		size = size ? size * 2 : 65536;
+		Arrivals = realloc(Arrivals, size * sizeof(struct s_arrival));
+		if ( ! Arrivals) {
+			perror("hl2_buffer_sim");
+			exit(1);
+		}
+	}
+	Arrivals[num_arrivals].time = time;
+	Arrivals[num_arrivals].sequence = sequence;
+	Arrivals[num_arrivals].mox = mox;
+	num_arrivals++;
+}
+
+static void read_text_trace(FILE * fp)
+{  // Each line is the arrival time, the sequence number and mox.
+	char line[BUFFER_SIZE];
+	double time;
+	unsigned int sequence;
+	int mox;
+
+	while (fgets(line, BUFFER_SIZE, fp))
+		if (sscanf(line, "%lf %u %d", &time, &sequence, &mox) == 3)
+			add_arrival(time, sequence, mox);
+}
+
+static uint32_t pcap_u32(uint8_t * pt, bool swap)
+{
+	if (swap)
+		return (uint32_t)pt[0] << 24 | pt[1] << 16 | pt[2] << 8 | pt[3];
+	return (uint32_t)pt[3] << 24 | pt[2] << 16 | pt[1] << 8 | pt[0];
+}
+
+static bool pcap_packet(uint8_t * pkt, int len, uint32_t link, double time)
+{  // Add the packet if it is a Tx packet sent to port 1024. Return false for an unknown link type.
+	uint8_t * ip, * udp, * data;
+	int offset, ether_type;
+
+	switch (link) {
+	case 1:		// Ethernet
+		offset = 14;
+		ether_type = pkt[12] << 8 | pkt[13];
+		if (ether_type == 0x8100) {	// VLAN tag
+			ether_type = pkt[16] << 8 | pkt[17];
+			offset = 18;
+		}
+		break;
+	case 113:	// Linux cooked capture
+		offset = 16;
+		ether_type = pkt[14] << 8 | pkt[15];
+		break;
+	case 101:	// raw IP
+		offset = 0;
+		ether_type = 0x0800;
+		break;
+	default:
+		fprintf(stderr, "Unknown pcap link type %u\n", link);
+		return false;
+	}
+	if (ether_type != 0x0800 || len < offset + 20)
+		return true;
+	ip = pkt + offset;
+	if ((ip[0] >> 4) != 4 || ip[9] != 17)		// IPv4 and UDP
+		return true;
+	udp = ip + (ip[0] & 0x0F) * 4;
+	data = udp + 8;
+	if (data + 12 > pkt + len)
+		return true;
+	if ((udp[2] << 8 | udp[3]) != 1024 || (udp[4] << 8 | udp[5]) != 1032 + 8)
+		return true;
+	if (data[0] != 0xEF || data[1] != 0xFE || data[2] != 0x01 || data[3] != 0x02)
+		return true;
+	add_arrival(time, (uint32_t)data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7], data[11] & 0x01);
+	return true;
+}
+
+static void read_pcap(FILE * fp, uint8_t header[])
+{  // Find the Tx packets sent to port 1024 in a classic pcap file.
+	uint8_t rec[16];
+	uint8_t pkt[BUFFER_SIZE];
+	uint32_t magic, link, incl_len;
+	bool swap, nsec;
+	int len;
+
+	magic = pcap_u32(header, false);
+	swap = magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1;
+	nsec = magic == 0xA1B23C4D || magic == 0x4D3CB2A1;
+	link = pcap_u32(header + 20, swap);
+	while (fread(rec, 1, 16, fp) == 16) {
+		incl_len = pcap_u32(rec + 8, swap);
+		len = incl_len < BUFFER_SIZE ? incl_len : BUFFER_SIZE;
+		if ((int)fread(pkt, 1, len, fp) != len)
+			break;
+		if (incl_len > (uint32_t)len)
+			fseek(fp, incl_len - len, SEEK_CUR);
+		if ( ! pcap_packet(pkt, len, link, pcap_u32(rec, swap) + pcap_u32(rec + 4, swap) * (nsec ? 1E-9 : 1E-6)))
+			return;
+	}
+}
+
+static void read_pcapng(FILE * fp)
+{  // Find the Tx packets sent to port 1024 in a pcapng file. This is the Wireshark default format.
+	uint8_t head[8];
+	uint8_t block[BUFFER_SIZE + 64];
+	uint32_t type, block_len, cap_len, iface, links[PCAPNG_IFACES];
+	double resolution[PCAPNG_IFACES];
+	uint64_t stamp;
+	int num_ifaces = 0, len, i, k, code, opt_len;
+	bool swap = false;
+
+	while (fread(head, 1, 8, fp) == 8) {
+		type = pcap_u32(head, swap);
+		if (type == 0x0A0D0D0A) {	// Section Header Block; it sets the byte order of the section
+			if (fread(block, 1, 4, fp) != 4)
+				break;
+			swap = pcap_u32(block, false) != 0x1A2B3C4D;
+			num_ifaces = 0;
+			block_len = pcap_u32(head + 4, swap);
+			if (block_len < 28 || fseek(fp, block_len - 12, SEEK_CUR) != 0)
+				break;
+			continue;
+		}
+		block_len = pcap_u32(head + 4, swap);
+		if (block_len < 12)
+			break;
+		len = block_len - 12 < sizeof(block) ? block_len - 12 : sizeof(block);
+		if ((int)fread(block, 1, len, fp) != len)
+			break;
+		if (fseek(fp, block_len - 12 - len + 4, SEEK_CUR) != 0)	// skip the rest of the body and the trailing length
+			break;
+		if (type == 1 && len >= 8) {	// Interface Description Block
+			if (num_ifaces >= PCAPNG_IFACES)
+				continue;
+			links[num_ifaces] = swap ? block[0] << 8 | block[1] : block[1] << 8 | block[0];
+			resolution[num_ifaces] = 1E-6;
+			for (i = 8; i + 4 <= len; i += 4 + (opt_len + 3) / 4 * 4) {	// options
+				code = swap ? block[i] << 8 | block[i + 1] : block[i + 1] << 8 | block[i];
+				opt_len = swap ? block[i + 2] << 8 | block[i + 3] : block[i + 3] << 8 | block[i + 2];
+				if (code == 0)		// end of options
+					break;
+				if (code == 9 && opt_len == 1 && i + 5 <= len)	// if_tsresol: a negative power of 10, or of 2 if the high bit is set
+					for (k = block[i + 4] & 0x7F, resolution[num_ifaces] = 1; k > 0; k--)
+						resolution[num_ifaces] /= block[i + 4] & 0x80 ? 2 : 10;
+			}
+			num_ifaces++;
+		}
+		else if (type == 6 && len >= 20) {	// Enhanced Packet Block
+			iface = pcap_u32(block, swap);
+			if (iface >= (uint32_t)num_ifaces)
+				continue;
+			stamp = (uint64_t)pcap_u32(block + 4, swap) << 32 | pcap_u32(block + 8, swap);
+			cap_len = pcap_u32(block + 12, swap);
+			if (cap_len > (uint32_t)len - 20)
+				cap_len = len - 20;
+			if ( ! pcap_packet(block + 20, cap_len, links[iface], stamp * resolution[iface]))
+				return;
+		}
+	}
+}
+
+static void simulate(int delay_ms, int keydown_ms, int drift, char * policy)
+{  // Replay the arrivals through TxBuf and print the results for one setting.
+	uint8_t buffer[BUFFER_SIZE];
+	uint8_t scratch[BUFFER_SIZE];
+	uint8_t * ptBuf;
+	uint32_t stamp;
+	double tick_time, residency, total = 0, worst = 0;
+	unsigned int count = 0, sum;
+	int i, next, bin, p99 = 0;
+
+	txbuf_used = (int)(delay_ms / 2.625 + 0.5);
+	if (txbuf_used < 8)
+		txbuf_used = 8;
+	txbuf_keydown = 0;
+	if (keydown_ms > 0) {
+		txbuf_keydown = (int)(keydown_ms / 2.625 + 0.5);
+		if (txbuf_keydown < 8)
+			txbuf_keydown = 8;
+		if (txbuf_keydown >= txbuf_used)
+			txbuf_keydown = 0;
+	}
+	txbuf_start = txbuf_keydown ? txbuf_keydown : txbuf_used;
+	drift_correct = drift;
+	txbuf_reset();
+	txbuf_last_good = 0;
+	txbuf_send_rqst = -1;
+	keydown_total = 0;
+	keydown_count = 0;
+	memset(residency_hist, 0, sizeof(residency_hist));
+	memset(buffer, 0, sizeof(buffer));
+	buffer[0] = 0xEF;
+	buffer[1] = 0xFE;
+	buffer[2] = 0x01;
+	buffer[3] = 0x02;
+	next = 0;
+	for (tick_time = Arrivals[0].time; next < num_arrivals; tick_time += 1.0 / TX_PACKET_RATE) {
+		while (next < num_arrivals && Arrivals[next].time <= tick_time) {
+			buffer[4] = Arrivals[next].sequence >> 24 & 0xFF;
+			buffer[5] = Arrivals[next].sequence >> 16 & 0xFF;
+			buffer[6] = Arrivals[next].sequence >>  8 & 0xFF;
+			buffer[7] = Arrivals[next].sequence       & 0xFF;
+			buffer[11] = buffer[523] = Arrivals[next].mox;
+			stamp = next + 1;	// each sample records the arrival it came from
+			for (i = 0; i < TX_SAMPLES; i++)
+				memcpy(buffer + TX_SAMPLE_OFFSET(i), &stamp, 4);
+			txbuf_insert(buffer, Arrivals[next].time);
+			next++;
+		}
+		txbuf_check_overflow();
+		if (txbuf_started == STARTUP) {
+			if (txbuf_fill(txbuf_read, txbuf_write) >= txbuf_start)
+				txbuf_started = NORMAL;
+			continue;
+		}
+		ptBuf = txbuf_tick(scratch, tick_time);
+		memcpy(&stamp, ptBuf + TX_SAMPLE_OFFSET(0), 4);
+		if (stamp == 0)		// zero samples for a missing packet or an underflow
+			continue;
+		residency = tick_time - Arrivals[stamp - 1].time;
+		total += residency;
+		count++;
+		if (worst < residency)
+			worst = residency;
+		bin = (int)(residency * 1E3);
+		if (bin >= SIM_RESIDENCY_BINS)
+			bin = SIM_RESIDENCY_BINS - 1;
+		residency_hist[bin]++;
+	}
+	for (sum = 0, bin = 0; bin < SIM_RESIDENCY_BINS; bin++) {
+		sum += residency_hist[bin];
+		if (sum >= count * 0.99) {
+			p99 = bin + 1;
+			break;
+		}
+	}
+	printf("%6d %-8s %9u %8u %8u %8u %9.0lf %9d %9.0lf %9.0lf\n", delay_ms, policy,
+		wifi_buffer_underflow, wifi_buffer_overflow, wifi_seq_missing, wifi_seq_out_of_order,
+		count ? total / count * 1E3 : 0.0, p99, worst * 1E3,
+		keydown_count ? keydown_total / keydown_count * 1E3 : 0.0);
+}
+
+int main(int argc, char * argv[])
+{
+	static int default_delays[] = {50, 100, 200, 300, 500, 1000, 2000};
+	int delays[64];
+	int i, num_delays = 0, keydown_ms = 0;
+	uint8_t header[24];
+	char * trace = NULL;
+	FILE * fp;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-k") == 0 && i + 1 < argc)
+			keydown_ms = atoi(argv[++i]);
+		else if ( ! trace)
+			trace = argv[i];
+		else if (num_delays < 64)
+			delays[num_delays++] = atoi(argv[i]);
+	}
+	if ( ! trace) {
+		fprintf(stderr, "Usage: hl2_buffer_sim [-k keydown_milliseconds] trace_file [buffer_milliseconds ...]\n");
+		return 2;
+	}
+	if (num_delays == 0) {
+		num_delays = sizeof(default_delays) / sizeof(int);
+		memcpy(delays, default_delays, sizeof(default_delays));
+	}
+	fp = fopen(trace, "rb");
+	if ( ! fp) {
+		perror(trace);
+		return 1;
+	}
+	if (fread(header, 1, 24, fp) == 24 && (pcap_u32(header, false) == 0xA1B2C3D4 || pcap_u32(header, false) == 0xA1B23C4D ||
+			pcap_u32(header, true) == 0xA1B2C3D4 || pcap_u32(header, true) == 0xA1B23C4D)) {
+		read_pcap(fp, header);
+	}
+	else if (pcap_u32(header, false) == 0x0A0D0D0A) {
+		rewind(fp);
+		read_pcapng(fp);
+	}
+	else {
+		rewind(fp);
+		read_text_trace(fp);
+	}
+	fclose(fp);
+	if (num_arrivals == 0) {
+		fprintf(stderr, "No Tx packets found in %s\n", trace);
+		return 1;
+	}
+	printf("%d Tx packets in %.1lf seconds\n", num_arrivals, Arrivals[num_arrivals - 1].time - Arrivals[0].time);
+	printf(" Delay Policy   Underflow Overflow  Missing OutOrder  Avg msec  P99 msec  Max msec  RF msec\n");
+	for (i = 0; i < num_delays; i++) {
+		if (delays[i] <= 0 || delays[i] > TX_DELAY_MAX)
+			continue;
+		simulate(delays[i], 0, 0, "fixed");
+		simulate(delays[i], 0, 1, "drift");
+		if (keydown_ms > 0)
+			simulate(delays[i], keydown_ms, 1, "keydown");
+	}
+	return 0;
+}
@@ -0,0 +1,123 @@
+#!/usr/bin/env python3
+# This software is Copyright (C) 2023-2024 by James C. Ahlstrom.
+# This free software is licensed for use under the GNU General Public
+# License (GPL), see http://www.opensource.org.
+# Note that there is NO WARRANTY AT ALL.  USE AT YOUR OWN RISK!!
+
+# A fake HL2 and a fake PC for testing hl2_wifi_buffer without hardware. It is used by hl2_bpf_test.sh.
+#   hl2_test_peer.py hl2 packets_per_second
+#   hl2_test_peer.py pc adapter_address seconds
+# The HL2 puts its send time in each Rx packet and the PC puts its send time in each Tx packet,
+# so the other end can measure the one-way delay through the adapter. All namespaces share CLOCK_MONOTONIC.
+
+import socket, struct, sys, time, threading
+
+SO_NO_CHECK = 11	# send with a zero UDP checksum like the HL2
+
+def udp_socket(port):
+  sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+  sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+  sock.setsockopt(socket.SOL_SOCKET, socket.SO_BROADCAST, 1)
+  sock.setsockopt(socket.SOL_SOCKET, SO_NO_CHECK, 1)
+  sock.bind(('', port))
+  return sock
+
+def packet(endpoint, seq, c1=0):
+  frame = struct.pack('>3B5B', 0x7F, 0x7F, 0x7F, 0, c1, 0, 0, 0)
+  data = bytearray(struct.pack('>4BI', 0xEF, 0xFE, 0x01, endpoint, seq) + frame + bytes(504) + frame + bytes(504))
+  struct.pack_into('>Q', data, 16, time.monotonic_ns())
+  return data
+
+def percentile(values, p):
+  if not values:
+    return 0.0
+  values = sorted(values)
+  return values[min(len(values) - 1, int(len(values) * p))]
+
+def hl2(rate):
+  sock = udp_socket(1024)
+  client = None
+  running = False
+  sent = received = 0
+  last_seq = None
+  seq_errors = 0
+  delays = []
+  next_time = time.monotonic()
+  sock.settimeout(0)
+  while True:
+    try:
+      while True:
+        data, addr = sock.recvfrom(2048)
+        if data[0:3] == b'\xEF\xFE\x02':	# discover
+          sock.sendto(b'\xEF\xFE\x02' + bytes.fromhex('00 1C C0 A2 13 DD') + bytes([73, 6]) + bytes(50), addr)
+        elif data[0:3] == b'\xEF\xFE\x04':	# start or stop
+          running = bool(data[3] & 0x01)
+          client = addr
+          next_time = time.monotonic()
+          if not running:
+            print("hl2: sent %d, received %d, sequence errors %d, PC to HL2 msec avg %.2f p99 %.2f" % (sent, received, seq_errors,
+              sum(delays) / len(delays) * 1E3 if delays else 0, percentile(delays, 0.99) * 1E3), flush=True)
+            sent = received = seq_errors = 0
+            last_seq = None
+            delays = []
+        elif len(data) == 1032 and data[3] == 0x02:
+          received += 1
+          seq = struct.unpack_from('>I', data, 4)[0]
+          if last_seq is not None and seq != (last_seq + 1) & 0xFFFFFFFF:
+            seq_errors += 1
+          last_seq = seq
+          ts = struct.unpack_from('>Q', data, 16)[0]
+          if ts:
+            delays.append((time.monotonic_ns() - ts) * 1E-9)
+    except BlockingIOError:
+      pass
+    now = time.monotonic()
+    if running and now >= next_time:
+      sock.sendto(packet(0x06, sent), client)
+      sent += 1
+      next_time += 1.0 / rate
+      if now - next_time > 0.1:	# do not try to catch up after a stall
+        next_time = now
+    else:
+      time.sleep(min(0.0002, max(0, next_time - now)) if running else 0.001)
+
+def pc(adapter, seconds):
+  sock = udp_socket(0)
+  sock.settimeout(2)
+  sock.sendto(b'\xEF\xFE\x02' + bytes(60), (adapter, 1024))
+  sock.recvfrom(2048)	# discover reply
+  delays = []
+  count = [0]
+  stop = threading.Event()
+  def receive():
+    sock.settimeout(0.5)
+    while not stop.is_set():
+      try:
+        data, addr = sock.recvfrom(2048)
+      except socket.timeout:
+        continue
+      if len(data) == 1032 and data[3] == 0x06:
+        count[0] += 1
+        delays.append((time.monotonic_ns() - struct.unpack_from('>Q', data, 16)[0]) * 1E-9)
+  thread = threading.Thread(target=receive)
+  thread.start()
+  sock.sendto(b'\xEF\xFE\x04\x01' + bytes(60), (adapter, 1024))
+  start = next_time = time.monotonic()
+  seq = 0
+  while time.monotonic() - start < seconds:	# Tx packets at 48 ksps with the speed set to 384 ksps
+    sock.sendto(packet(0x02, seq, c1=0x03), (adapter, 1024))
+    seq += 1
+    next_time += 126 / 48000
+    time.sleep(max(0, next_time - time.monotonic()))
+  sock.sendto(b'\xEF\xFE\x04\x00' + bytes(60), (adapter, 1024))
+  stop.set()
+  thread.join()
+  print("pc: sent %d, received %d, HL2 to PC msec avg %.3f p50 %.3f p99 %.3f max %.3f" % (seq, count[0],
+    sum(delays) / len(delays) * 1E3 if delays else 0, percentile(delays, 0.5) * 1E3,
+    percentile(delays, 0.99) * 1E3, max(delays) * 1E3 if delays else 0), flush=True)
+
+if __name__ == '__main__':
+  if sys.argv[1] == 'hl2':
+    hl2(float(sys.argv[2]))
+  else:
+    pc(sys.argv[2], float(sys.argv[3]))
@@ -20,28 +20,59 @@
 #include <net/if.h>
 #include <ifaddrs.h>
 #include <stdlib.h>
-
-#define DEBUG	0
+#include <semaphore.h>
+#include <sys/stat.h>
+#include <linux/sock_diag.h>
+#include <signal.h>
+#include "hl2_bpf.h"
+#include "txbuf.h"
+#ifdef HL2_BPF
+#include <sys/mman.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+#endif
 
 #define HTML_PORT	8080
-#define BUFFER_SIZE	2048
-#define NAME_SIZE	80
-#define TX_BUF_BYTES	1038
-#define TX_BUF_EMPTY	(txbuf_read == txbuf_write)
-
-#define TX_DELAY_MAX	4000	// maximum delay msec from the configuration file
-// The Tx data rate is 48000 sps with 126 I/Q samples per UDP packet, or one UDP packet every 2.625 milliseconds.
-// The buffer space used txbuf_used is delay / 2.625, but can range up to twice this.
-// The buffer size TX_BUF_COUNT must be at least twice this, and must be a power of two.
-// So TX_BUF_COUNT must be at least (TX_DELAY_MAX / 2.625 * 2) * 2.
-#define TX_BUF_BITS	13	// number of address bits
-#define TX_BUF_COUNT	(1 << TX_BUF_BITS)
-#define TX_BUF_MASK	(TX_BUF_COUNT - 1)
+
+// The trace file is written by its own thread. The WiFi thread puts each Tx packet arrival in this ring.
+#define TRACE_SLOTS	4096		// must be a power of two; ten seconds of packets
+#define TRACE_MASK	(TRACE_SLOTS - 1)
+#define TRACE_MAX_BYTES	(100 * 1024 * 1024)	// stop recording when the trace file is this big
+#define TRACE_SLEEP	100000		// microseconds between writes
+
+// Multipath: the client sends the same packets on two WiFi interfaces, and the first copy is used.
+#define MP_BITS		12		// sequence numbers remembered to find duplicates
+#define MP_SIZE		(1 << MP_BITS)
+#define MP_MASK		(MP_SIZE - 1)
+#define MP_DUP_TIME	0.1		// seconds; an identical control packet on the other path is a duplicate
+
+// Packets from the HL2 to WiFi are sent by their own thread through this queue.
+#define DL_SLOTS	256		// must be a power of two
+#define DL_MASK		(DL_SLOTS - 1)
+
+// Fan-out: clients other than the primary client can register as listeners and get a copy of the HL2 data.
+#define MAX_LISTENERS		8
+#define LISTENER_TIMEOUT	5.0	// seconds; drop a listener that sends nothing
+#define LISTENER_MAX_BUSY	381	// drop a listener when its failed sends exceed its good sends by this many; one second at 48 ksps
+#define PRIMARY_TIMEOUT		1.0	// seconds; a Start from another client takes over from a silent primary client
+
+// Socket buffers are sized to hold this many seconds of packets. Each packet uses about SOCK_TRUESIZE bytes.
+#define SOCK_HOLD	0.2
+#define SOCK_TRUESIZE	2304
+#define SOCK_MIN_BUF	(256 * 1024)
+#define SOCK_HL2	0		// index into SockStats
+#define SOCK_WIFI	1
+#define SOCK_1025	2
+
+// Discover replies from the HL2 are saved, and later client discover packets are answered from the cache.
+#define DISCOVER_REFRESH	10	// seconds; refresh the cache with a unicast discover when it is this old
+#define DISCOVER_MAX_AGE	30	// seconds; discard the cache if the HL2 does not answer a refresh
 
 static int sock_hl2, sock_wifi_1024, sock_wifi_1025;
 static int sock_listen;
 static int delay;
 static uint32_t HL2_sequence;
+static uint32_t * hl2_sequence_pt = &HL2_sequence;	// the sequence counter; shared with the kernel fast path
 static struct sockaddr_in sockaddr_in_client_1024, sockaddr_in_client_1025, sockaddr_in_hl2_1024, sockaddr_in_hl2_1025;
 static struct in_addr hl2_hostaddr;
 static struct in_addr wifi_hostaddr;
@@ -49,115 +80,905 @@ static double wifi_up_rate, wifi_down_rate;
 static double wifi_jitter=0;
 static double HL2_jitter=0;
 static unsigned int wifi_up_bytes, wifi_down_bytes;
-static uint8_t num_receivers = 1;
-static int sample_rate = 48000;
-static int mox = 0;
-static int txbuf_read = 0;
-static int txbuf_write = 0;
-static int txbuf_send_rqst = -1;
-static int txbuf_used;
+static int keydown_delay = 0;	// fast key-down milliseconds from the configuration file
 static unsigned int hl2_rx_samples = 0;
 static unsigned int hl2_buffer_faults = 0;
-static unsigned int wifi_buffer_overflow = 0;
-static unsigned int wifi_buffer_underflow = 0;
-static uint16_t wifi_seq_duplicate;
-static uint16_t wifi_seq_out_of_order;
-static uint16_t wifi_seq_missing;
 static char wifi_iface[NAME_SIZE + 4], hl2_iface[NAME_SIZE + 4];
-static pthread_mutex_t HL2_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-enum {
-	STARTUP,
-	NORMAL,
-	RESTARTING
-} txbuf_started;
-
-enum _txbuf_state{
-	EMPTY,
-	FILLED,
-	ZEROED,
-	FILLED_RQST
-} ;
-
-static struct s_txbuf {
-	enum _txbuf_state txbuf_state;
-	uint8_t buf[TX_BUF_BYTES];
-} TxBuf[TX_BUF_COUNT];
-
-static double QuiskTimeSec(void)
-{
-	struct timespec ts;
-#ifdef CLOCK_MONOTONIC_RAW
-	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) != 0)
-#else
-	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+static char wifi_iface2[NAME_SIZE + 4];	// the second WiFi interface for multipath, or blank
+static int multipath_downlink = 2;	// 0: last path; 1: both paths; 2: the healthier path
+static unsigned int wifi_ifindex[2];
+static uint32_t mp_seen[MP_SIZE];	// sequence number plus one of the packets received
+static double mp_seen_time[MP_SIZE];	// time of the first arrival
+
+static struct s_path {		// statistics for each WiFi path
+	struct sockaddr_in client;	// client address on this path, or zero
+	uint32_t first_seq, last_seq;
+	unsigned int packets;		// Tx packets received on this path
+	unsigned int wins;		// packets that arrived first on this path
+	double lag_total;		// time behind the other path for packets that arrived second
+	unsigned int lag_count;
+	double health;			// average fraction of first arrivals; used to steer the downlink
+} WifiPath[2];
+
+static struct s_downlink {	// queue of packets to WiFi; when full the oldest packet is dropped
+	int len;
+	int port;		// 1024 or 1025
+	bool primary;		// send to the primary client; false if the kernel fast path already sent it
+	uint8_t buf[BUFFER_SIZE];
+} Downlink[DL_SLOTS];
+static unsigned int dl_head = 0;	// written by the HL2 thread
+static unsigned int dl_tail = 0;	// advanced by the downlink thread, or by the HL2 thread to drop a packet
+static sem_t dl_sem;
+static unsigned int dl_high_water = 0;
+static unsigned int dl_dropped = 0;	// oldest packets dropped because the queue was full
+static unsigned int dl_busy = 0;	// packets dropped because the WiFi socket was full
+
+static int max_listeners = 0;		// fan-out listeners from the configuration file
+static pthread_mutex_t listener_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct s_listener {	// a client that gets a copy of the HL2 data
+	struct sockaddr_in addr;	// zero if the slot is free
+	int sock;			// our port 1024 connected to the listener
+	bool dropped;			// dropped by the downlink thread; the WiFi thread closes the socket
+	double last_time;		// time of the last packet from the listener
+	unsigned int busy;		// failed sends less good sends
+	unsigned int sent, failed;
+} Listeners[MAX_LISTENERS];
+static unsigned int listener_count = 0;
+static unsigned int listeners_dropped = 0;
+static double primary_time = 0;		// time of the last packet from the primary client
+
+static struct s_sock_stats {	// kernel statistics for each receive socket
+	uint32_t kernel_drops;		// datagrams dropped by the kernel, from SO_RXQ_OVFL
+	unsigned int packets;
+	unsigned int rx_queue_max;	// bytes in the receive queue, sampled
+	unsigned int tx_queue_max;	// bytes in the send queue, sampled
+	int rcvbuf, sndbuf;		// buffer sizes set by the kernel
+} SockStats[3];
+static char trace_name[NAME_SIZE + 4];	// record the Tx packet arrival times in this file
+static FILE * trace_fp = NULL;		// written by the trace thread, and on exit
+static struct s_trace {
+	double time;
+	uint32_t seq;
+	uint8_t mox;
+} Trace[TRACE_SLOTS];
+static unsigned int trace_head = 0;	// written by the WiFi thread
+static unsigned int trace_tail = 0;	// written by the trace thread
+static unsigned int trace_dropped = 0;	// arrivals lost because the ring was full
+static long trace_bytes = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int bpf_fast_path = 0;		// use the kernel fast path from the configuration file
+static struct hl2_bpf_config * bpf_config = NULL;	// the kernel fast path configuration, or NULL if not loaded
+#ifdef HL2_BPF
+static struct bpf_object * bpf_obj;
+static struct bpf_tc_hook bpf_hook[2];	// index 0 is the HL2 interface and index 1 is the WiFi interface
+static struct bpf_tc_opts bpf_opts[2];
+static int bpf_stats_fd = -1;
 #endif
+static int discover_cache_enable = 1;
+static bool hl2_running = false;	// the client sent a Start packet
+static unsigned int discover_hits = 0;
+static unsigned int discover_misses = 0;
+static double discover_hit_time = 0;	// total response time for cache hits
+static double discover_miss_time = 0;	// total response time for forwarded discover packets
+static unsigned int discover_miss_replies = 0;
+static pthread_mutex_t discover_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct s_discover {	// index 0 is port 1024 and index 1 is port 1025
+	uint8_t buf[BUFFER_SIZE];	// the discover reply from the HL2; len is zero if the cache is invalid
+	int len;
+	int link_id;			// the HL2 link state when the reply was saved
+	double time;			// time the reply was saved
+	double refresh_time;		// time of the last unicast refresh
+	double forward_time;		// time a client discover was forwarded to the HL2, or zero
+	struct sockaddr_in hl2addr;
+	struct sockaddr_in client;	// the client that sent the forwarded discover
+} DiscoverCache[2];
+
+static void replace_hl2_sequence(uint8_t * buffer)	// regenerate sequence numbers sent to the HL2
+{
+	uint32_t seq = __atomic_fetch_add(hl2_sequence_pt, 1, __ATOMIC_RELAXED);
+
+	buffer[4] = seq >> 24 & 0xFF;
+	buffer[5] = seq >> 16 & 0xFF;
+	buffer[6] = seq >>  8 & 0xFF;
+	buffer[7] = seq       & 0xFF;
+}
+
+static inline void trace_add(double dtime, uint8_t * buffer)
+// Put the arrival of a Tx packet in the trace ring. Call from the WiFi thread.
+{
+	struct s_trace * slot;
+
+	if (trace_head - __atomic_load_n(&trace_tail, __ATOMIC_ACQUIRE) >= TRACE_SLOTS) {
+		trace_dropped++;
+		return;
+	}
+	slot = Trace + (trace_head & TRACE_MASK);
+	slot->time = dtime;
+	slot->seq = (uint32_t)buffer[4] << 24 | buffer[5] << 16 | buffer[6] << 8 | buffer[7];
+	slot->mox = buffer[11] & 0x01;
+	__atomic_store_n(&trace_head, trace_head + 1, __ATOMIC_RELEASE);
+}
+
+static bool trace_write(void)
+// Write the arrivals in the ring to the trace file. Close the file when it reaches TRACE_MAX_BYTES.
+// Return false when the file is closed.
+{
+	struct s_trace * slot;
+	unsigned int head;
+	bool open;
+	int n;
+
+	pthread_mutex_lock(&trace_mutex);
+	head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+	while (trace_fp && trace_tail != head) {
+		slot = Trace + (trace_tail & TRACE_MASK);
+		n = fprintf(trace_fp, "%.6lf %u %d\n", slot->time, slot->seq, slot->mox);	// for hl2_buffer_sim
+		__atomic_store_n(&trace_tail, trace_tail + 1, __ATOMIC_RELEASE);
+		if (n > 0)
+			trace_bytes += n;
+		if (n < 0 || trace_bytes >= TRACE_MAX_BYTES) {
+			fprintf(stderr, n < 0 ? "Can't write the trace file\n" : "The trace file is full\n");
+			fclose(trace_fp);
+			trace_fp = NULL;
+		}
+	}
+	if (trace_fp)
+		fflush(trace_fp);
+	open = trace_fp != NULL;
+	pthread_mutex_unlock(&trace_mutex);
+	return open;
+}
+
+static void trace_close(void)
+{  // Write the last arrivals and close the trace file on exit.
+	trace_write();
+	pthread_mutex_lock(&trace_mutex);
+	if (trace_fp) {
+		if (trace_dropped)
+			fprintf(stderr, "%u trace records were lost\n", trace_dropped);
+		fclose(trace_fp);
+		trace_fp = NULL;
+	}
+	pthread_mutex_unlock(&trace_mutex);
+}
+
+static void * trace_writer(void * arg)
+{  // Write the trace file, so the WiFi thread never waits for the disk.
+	do {
+		usleep(TRACE_SLEEP);
+	} while (trace_write());
+	return NULL;
+}
+
+static int hl2_link_id(void)
+// Return an identifier for the state of the HL2 link, or -1 if the link is down.
+// The identifier changes if the link goes down and up again.
+{
+	struct ifreq ifr;
+	FILE * fp;
+	char name[NAME_SIZE * 2];
+	int changes = 0;
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, hl2_iface, IFNAMSIZ - 1);
+	if (ioctl(sock_hl2, SIOCGIFFLAGS, &ifr) != 0 || ! (ifr.ifr_flags & IFF_RUNNING))
+		return -1;
+	snprintf(name, sizeof(name), "/sys/class/net/%s/carrier_changes", hl2_iface);
+	fp = fopen(name, "r");
+	if (fp) {
+		if (fscanf(fp, "%d", &changes) != 1)
+			changes = 0;
+		fclose(fp);
+	}
+	return changes;
+}
+
+static bool discover_reply(int index, int sock, uint8_t * request, int request_len, struct sockaddr_in * client, double dtime)
+// Answer a client discover packet from the cache. Return false if the packet must be forwarded to the HL2.
+{
+	struct s_discover * pt = DiscoverCache + index;
+	struct sockaddr_in hl2addr;
+	uint8_t buffer[BUFFER_SIZE];
+	int len;
+	bool refresh;
+
+	if ( ! discover_cache_enable)
+		return false;
+	pthread_mutex_lock(&discover_mutex);
+	if (pt->len && (pt->link_id != hl2_link_id() || ( ! hl2_running && dtime - pt->time > DISCOVER_MAX_AGE))) {
+		if (DEBUG)
+			printf("Discover cache %d invalidated\n", index);
+		pt->len = 0;
+	}
+	if (pt->len == 0) {
+		pthread_mutex_unlock(&discover_mutex);
+		return false;
+	}
+	len = pt->len;
+	memcpy(buffer, pt->buf, len);
+	hl2addr = pt->hl2addr;
+	// Refresh the cache in the background, but not while the HL2 is streaming.
+	refresh = ! hl2_running && dtime - pt->time > DISCOVER_REFRESH && dtime - pt->refresh_time > DISCOVER_REFRESH;
+	if (refresh)
+		pt->refresh_time = dtime;
+	pthread_mutex_unlock(&discover_mutex);
+	buffer[2] = hl2_running ? 0x03 : 0x02;	// the HL2 reports whether it is sending
+	if (sendto(sock, buffer, len, 0, (struct sockaddr *)client, sizeof(struct sockaddr_in)) != len)
+		perror("Send cached discover reply");
+	pthread_mutex_lock(&discover_mutex);
+	discover_hits++;
+	discover_hit_time += QuiskTimeSec() - dtime;
+	pthread_mutex_unlock(&discover_mutex);
+	if (refresh)	// a unicast discover to the known HL2 address; the reply is not forwarded
+		if (sendto(sock_hl2, request, request_len, 0, (struct sockaddr *)&hl2addr, sizeof(struct sockaddr_in)) != request_len)
+			perror("Refresh discover cache");
+	return true;
+}
+
+static void discover_forward(int index, uint8_t * request, int request_len, struct sockaddr_in * client, double dtime)
+// Broadcast a client discover packet to the HL2. The reply is sent to this client.
+{
+	struct s_discover * pt = DiscoverCache + index;
+	struct sockaddr_in addr;
+
+	pthread_mutex_lock(&discover_mutex);
+	if (discover_cache_enable)
+		discover_misses++;
+	pt->forward_time = dtime;
+	pt->client = *client;
+	pthread_mutex_unlock(&discover_mutex);
+	memset(&addr, 0, sizeof(struct sockaddr_in));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(1024 + index);
+	inet_aton("169.254.255.255", &addr.sin_addr);
+	if (sendto(sock_hl2, request, request_len, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) != request_len)
+		perror("Forward discover packet");
+}
+
+static bool discover_save(int index, uint8_t * buffer, int recv_len, struct sockaddr_in * addr, struct sockaddr_in * client)
+// Save a discover reply from the HL2. Return true if a client is waiting for the reply, and return the client.
+{
+	struct s_discover * pt = DiscoverCache + index;
+	double dtime;
+	bool waiting;
+
+	dtime = QuiskTimeSec();
+	pthread_mutex_lock(&discover_mutex);
+	*client = pt->client;
+	if ( ! discover_cache_enable) {	// all replies are forwarded
+		pthread_mutex_unlock(&discover_mutex);
+		return true;
+	}
+	memcpy(pt->buf, buffer, recv_len);
+	pt->len = recv_len;
+	pt->link_id = hl2_link_id();
+	pt->time = dtime;
+	pt->hl2addr = *addr;
+	waiting = pt->forward_time != 0;
+	if (waiting) {
+		discover_miss_replies++;
+		discover_miss_time += dtime - pt->forward_time;
+		pt->forward_time = 0;
+	}
+	pthread_mutex_unlock(&discover_mutex);
+	return waiting;
+}
+
+static int recv_counted(int sock, uint8_t * buffer, int size, struct sockaddr_in * addr, int * path, struct s_sock_stats * stats)
+// Read a packet and record the kernel drop count for the socket. If path is not NULL, return the WiFi
+// path the packet arrived on: 0 for wifi_iface and 1 for wifi_iface2.
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr * cmsg;
+	char control[CMSG_SPACE(sizeof(struct in_pktinfo)) + CMSG_SPACE(sizeof(uint32_t))];
+	uint32_t meminfo[SK_MEMINFO_VARS];
+	socklen_t len;
+	int recv_len;
+
+	iov.iov_base = buffer;
+	iov.iov_len = size;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = addr;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	recv_len = recvmsg(sock, &msg, 0);
+	if (path)
+		*path = 0;
+	if (recv_len <= 0)
+		return recv_len;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+			memcpy(&stats->kernel_drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+		else if (path && cmsg->cmsg_level == IPPROTO_IP && cmsg->cmsg_type == IP_PKTINFO)
+			if (((struct in_pktinfo *)CMSG_DATA(cmsg))->ipi_ifindex == (int)wifi_ifindex[1])
+				*path = 1;
+	}
+	if ((stats->packets++ & 0x1F) == 0) {	// sample the queue sizes
+		len = sizeof(meminfo);
+		if (getsockopt(sock, SOL_SOCKET, SO_MEMINFO, meminfo, &len) == 0) {
+			if (stats->rx_queue_max < meminfo[SK_MEMINFO_RMEM_ALLOC])
+				stats->rx_queue_max = meminfo[SK_MEMINFO_RMEM_ALLOC];
+			if (stats->tx_queue_max < meminfo[SK_MEMINFO_WMEM_ALLOC])
+				stats->tx_queue_max = meminfo[SK_MEMINFO_WMEM_ALLOC];
+		}
+	}
+	return recv_len;
+}
+
+static void set_socket_buffer(int sock, int option, int force_option, int bytes, int * result)
+// Set a socket buffer size. Use the FORCE option if we are privileged, since it ignores the rmem_max limit.
+{
+	socklen_t len = sizeof(int);
+
+	if (bytes < SOCK_MIN_BUF)
+		bytes = SOCK_MIN_BUF;
+	if (setsockopt(sock, SOL_SOCKET, force_option, &bytes, sizeof(int)) != 0)
+		if (setsockopt(sock, SOL_SOCKET, option, &bytes, sizeof(int)) != 0)
+			perror("setsockopt buffer size failed");
+	if (getsockopt(sock, SOL_SOCKET, option, result, &len) != 0)
+		*result = 0;
+}
+
+static void size_socket_buffers(void)
+// Size the socket buffers for the sample rate, the number of receivers and the Tx buffer delay.
+// Call from the downlink thread, or from main before the threads start.
+{
+	double rx_rate, tx_rate, hold;
+
+	rx_rate = (double)sample_rate / ((504 / (num_receivers * 6 + 2)) * 2);	// HL2 packets per second
+	tx_rate = TX_PACKET_RATE;
+	hold = delay > SOCK_HOLD * 1E3 ? delay * 1E-3 : SOCK_HOLD;	// WiFi can deliver a whole delay at once
+	set_socket_buffer(sock_hl2, SO_RCVBUF, SO_RCVBUFFORCE, rx_rate * SOCK_HOLD * SOCK_TRUESIZE, &SockStats[SOCK_HL2].rcvbuf);
+	set_socket_buffer(sock_hl2, SO_SNDBUF, SO_SNDBUFFORCE, tx_rate * SOCK_HOLD * SOCK_TRUESIZE, &SockStats[SOCK_HL2].sndbuf);
+	set_socket_buffer(sock_wifi_1024, SO_RCVBUF, SO_RCVBUFFORCE, tx_rate * hold * 2 * SOCK_TRUESIZE, &SockStats[SOCK_WIFI].rcvbuf);
+	set_socket_buffer(sock_wifi_1024, SO_SNDBUF, SO_SNDBUFFORCE, rx_rate * SOCK_HOLD * SOCK_TRUESIZE, &SockStats[SOCK_WIFI].sndbuf);
+	// Port 1025 carries only discover and setup packets
+	set_socket_buffer(sock_wifi_1025, SO_RCVBUF, SO_RCVBUFFORCE, SOCK_MIN_BUF, &SockStats[SOCK_1025].rcvbuf);
+	set_socket_buffer(sock_wifi_1025, SO_SNDBUF, SO_SNDBUFFORCE, SOCK_MIN_BUF, &SockStats[SOCK_1025].sndbuf);
+	if (DEBUG)
+		printf("Socket buffers HL2 %d %d, WiFi %d %d, WiFi 1025 %d %d\n", SockStats[SOCK_HL2].rcvbuf, SockStats[SOCK_HL2].sndbuf,
+			SockStats[SOCK_WIFI].rcvbuf, SockStats[SOCK_WIFI].sndbuf, SockStats[SOCK_1025].rcvbuf, SockStats[SOCK_1025].sndbuf);
+}
+
+static unsigned int proc_udp_drops(int sock)
+// Return the drops for this socket from /proc/net/udp.
+{
+	struct stat st;
+	FILE * fp;
+	char line[BUFFER_SIZE];
+	unsigned long inode;
+	unsigned int drops;
+
+	if (fstat(sock, &st) != 0)
+		return 0;
+	fp = fopen("/proc/net/udp", "r");
+	if ( ! fp)
 		return 0;
-	return (double)ts.tv_sec + ts.tv_nsec * 1E-9;
+	while (fgets(line, BUFFER_SIZE, fp)) {
+		// sl local rem st tx:rx tr:when retrnsmt uid timeout inode ref pointer drops
+		if (sscanf(line, " %*s %*s %*s %*s %*s %*s %*s %*s %*s %lu %*s %*s %u", &inode, &drops) == 2 && inode == st.st_ino) {
+			fclose(fp);
+			return drops;
+		}
+	}
+	fclose(fp);
+	return 0;
 }
 
-static void replace_hl2_sequence(uint8_t * buffer)	// regenerate sequence numbers sent to the HL2
+static void multipath_reset(void)
 {
-	buffer[4] = HL2_sequence >> 24 & 0xFF;
-	buffer[5] = HL2_sequence >> 16 & 0xFF;
-	buffer[6] = HL2_sequence >>  8 & 0xFF;
-	buffer[7] = HL2_sequence       & 0xFF;
-	HL2_sequence++;
+	memset(mp_seen, 0, sizeof(mp_seen));
+	memset(WifiPath, 0, sizeof(WifiPath));
 }
 
-static inline uint16_t txbuf_fill(uint16_t uMin, uint16_t uMax)
-// Return the number of records in the buffer.
-// Records start at index uMin and continue to index uMax - 1.
+static bool multipath_receive(int path, uint8_t * buffer, int recv_len, struct sockaddr_in * addr, double dtime)
+// Record a packet from a WiFi path. Return false if it is a duplicate of a packet from the other path.
 {
-	if (uMax >= uMin)
-		return uMax - uMin;
-	else
-		return TX_BUF_COUNT - uMin + uMax;
+	struct s_path * pt = WifiPath + path;
+	static uint8_t last_control[16];
+	static int last_len = 0, last_path = 0;
+	static double last_time = 0;
+	uint32_t seq;
+	int index;
+
+	pt->client = *addr;
+	if ( ! (recv_len == 1032 && buffer[3] == 0x02)) {	// control packets have no useful sequence number
+		if (recv_len == last_len && path != last_path && dtime - last_time < MP_DUP_TIME &&
+				memcmp(buffer, last_control, recv_len < 16 ? recv_len : 16) == 0)
+			return false;
+		memcpy(last_control, buffer, recv_len < 16 ? recv_len : 16);
+		last_len = recv_len;
+		last_path = path;
+		last_time = dtime;
+		return true;
+	}
+	seq = (uint32_t)buffer[4] << 24 | buffer[5] << 16 | buffer[6] << 8 | buffer[7];
+	if (pt->packets++ == 0)
+		pt->first_seq = seq;
+	pt->last_seq = seq;
+	index = seq & MP_MASK;
+	if (mp_seen[index] == seq + 1) {	// the other path was first
+		pt->lag_total += dtime - mp_seen_time[index];
+		pt->lag_count++;
+		return false;
+	}
+	mp_seen[index] = seq + 1;
+	mp_seen_time[index] = dtime;
+	pt->wins++;
+	pt->health += (1.0 - pt->health) * 0.01;
+	WifiPath[path ^ 1].health *= 0.99;
+	return true;
 }
 
-static void read_C0(uint8_t buffer[])
+static void send_path(int path, uint8_t * buffer, int len)
+// Send a packet to the client on one WiFi path.
 {
-	uint8_t C0_addr, speed;
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr * cmsg;
+	struct in_pktinfo * info;
+	char control[CMSG_SPACE(sizeof(struct in_pktinfo))];
 
-	mox = buffer[11] & 0x01;
-	C0_addr = (buffer[11] >> 1) & 0x3F;
-	if (C0_addr == 0) {
-		speed = buffer[12] & 0x03;
-		num_receivers = ((buffer[15] >> 3) & 0x0F) + 1;
+	if (WifiPath[path].client.sin_addr.s_addr == 0)
+		return;
+	iov.iov_base = buffer;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	memset(control, 0, sizeof(control));
+	msg.msg_name = &WifiPath[path].client;
+	msg.msg_namelen = sizeof(struct sockaddr_in);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = IPPROTO_IP;
+	cmsg->cmsg_type = IP_PKTINFO;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(struct in_pktinfo));
+	info = (struct in_pktinfo *)CMSG_DATA(cmsg);
+	info->ipi_ifindex = wifi_ifindex[path];		// send on the interface for this path
+	if (sendmsg(sock_wifi_1024, &msg, MSG_DONTWAIT) != len) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			dl_busy++;
+		else
+			perror("Forward 1024 from HL2 to path");
 	}
-	else {
-		C0_addr = (buffer[523] >> 1) & 0x3F;
-		if (C0_addr == 0) {
-			speed = buffer[524] & 0x03;
-			num_receivers = ((buffer[527] >> 3) & 0x0F) + 1;
+}
+
+static void wifi_send_1024(uint8_t * buffer, int len)
+// Send a packet from the HL2 to the client on port 1024.
+{
+	int path;
+
+	if ( ! wifi_iface2[0] || multipath_downlink == 0) {
+		if (sendto(sock_wifi_1024, buffer, len, MSG_DONTWAIT, (struct sockaddr *)&sockaddr_in_client_1024, sizeof(struct sockaddr_in)) != len) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				dl_busy++;
+			else
+				perror("Forward 1024 from HL2");
 		}
 	}
-	if (C0_addr == 0) {
-		switch (speed) {
-		case 0:
-		default:
-			sample_rate = 48000;
-			break;
-		case 1:
-			sample_rate = 96000;
-			break;
-		case 2:
-			sample_rate = 192000;
+	else if (multipath_downlink == 1) {
+		send_path(0, buffer, len);
+		send_path(1, buffer, len);
+	}
+	else {
+		path = WifiPath[1].health > WifiPath[0].health ? 1 : 0;
+		if (WifiPath[path].client.sin_addr.s_addr == 0)
+			path ^= 1;
+		send_path(path, buffer, len);
+	}
+}
+
+static int listener_open(struct sockaddr_in * addr)
+// Return a UDP socket on our port 1024 connected to the listener. Each listener has its own socket, so a
+// listener that is slow to take its packets fills only its own send buffer. The kernel delivers the packets
+// from the listener to this socket instead of sock_wifi_1024, so the WiFi thread reads it too.
+{
+	struct sockaddr_in bind_addr;
+	int one = 1;
+	int sock;
+
+	sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (sock < 0) {
+		perror("Can't create listener socket");
+		return -1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int));
+	memset(&bind_addr, 0, sizeof(bind_addr));
+	bind_addr.sin_family = AF_INET;
+	bind_addr.sin_port = htons(1024);
+	bind_addr.sin_addr.s_addr = INADDR_ANY;
+	if (bind(sock, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) != 0 ||
+			connect(sock, (struct sockaddr *)addr, sizeof(struct sockaddr_in)) != 0) {
+		perror("Can't bind listener socket");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static void listener_close(struct s_listener * slot)
+// Remove a listener. Call with listener_mutex held, from the WiFi thread only, because it polls the socket.
+{
+	close(slot->sock);
+	memset(slot, 0, sizeof(struct s_listener));
+	listener_count--;
+}
+
+static void listener_packet(uint8_t * buffer, int len, struct sockaddr_in * addr, double dtime)
+// Handle a packet from a client that is not the primary client. A Start packet registers it as a listener
+// and a Stop packet removes it. Its other packets are ignored, because only the primary client controls the HL2.
+{
+	struct s_listener * slot = NULL;
+	int i, sock;
+
+	pthread_mutex_lock(&listener_mutex);
+	for (i = 0; i < max_listeners; i++) {
+		if (Listeners[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && Listeners[i].addr.sin_port == addr->sin_port) {
+			slot = Listeners + i;
 			break;
-		case 3:
-			sample_rate = 384000;
+		}
+	}
+	if (len >= 4 && buffer[0] == 0xEF && buffer[1] == 0xFE && buffer[2] == 4) {	// Start or Stop Packet
+		if ( ! (buffer[3] & 0x01)) {
+			if (slot) {
+				listener_close(slot);
+				slot = NULL;
+			}
+		}
+		else if ( ! slot) {
+			for (i = 0; i < max_listeners; i++) {
+				if (Listeners[i].addr.sin_addr.s_addr == 0) {
+					sock = listener_open(addr);
+					if (sock < 0)
+						break;
+					slot = Listeners + i;
+					memset(slot, 0, sizeof(struct s_listener));
+					slot->addr = *addr;
+					slot->sock = sock;
+					listener_count++;
+					if (DEBUG)
+						printf("Listener %s:%d added\n", inet_ntoa(addr->sin_addr), ntohs(addr->sin_port));
+					break;
+				}
+			}
+		}
+	}
+	if (slot)
+		slot->last_time = dtime;
+	pthread_mutex_unlock(&listener_mutex);
+}
+
+static void listener_remove(struct sockaddr_in * addr)
+{
+	int i;
+
+	pthread_mutex_lock(&listener_mutex);
+	for (i = 0; i < max_listeners; i++)
+		if (Listeners[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr && Listeners[i].addr.sin_port == addr->sin_port)
+			listener_close(Listeners + i);
+	pthread_mutex_unlock(&listener_mutex);
+}
+
+static void listeners_clear(void)
+{
+	int i;
+
+	pthread_mutex_lock(&listener_mutex);
+	for (i = 0; i < max_listeners; i++)
+		if (Listeners[i].addr.sin_addr.s_addr != 0)
+			listener_close(Listeners + i);
+	pthread_mutex_unlock(&listener_mutex);
+}
+
+static int recv_wifi_1024(uint8_t * buffer, int size, struct sockaddr_in * addr, int * path)
+// Read the next packet for port 1024 from sock_wifi_1024 or from a listener socket. Close the sockets
+// of listeners dropped by fanout_send(). Call from the WiFi thread only.
+{
+	struct pollfd fds[MAX_LISTENERS + 1];
+	static struct s_sock_stats listener_stats;
+	int i, n;
+
+	while (listener_count) {
+		fds[0].fd = sock_wifi_1024;
+		fds[0].events = POLLIN;
+		pthread_mutex_lock(&listener_mutex);
+		for (n = 1, i = 0; i < max_listeners; i++) {
+			if (Listeners[i].addr.sin_addr.s_addr == 0)
+				continue;
+			if (Listeners[i].dropped) {
+				listener_close(Listeners + i);
+				continue;
+			}
+			fds[n].fd = Listeners[i].sock;
+			fds[n++].events = POLLIN;
+		}
+		pthread_mutex_unlock(&listener_mutex);
+		if (poll(fds, n, 100) <= 0)	// time out to close dropped listeners
+			continue;
+		if (fds[0].revents)
 			break;
+		for (i = 1; i < n; i++)
+			if (fds[i].revents)
+				return recv_counted(fds[i].fd, buffer, size, addr, NULL, &listener_stats);
+	}
+	return recv_counted(sock_wifi_1024, buffer, size, addr, path, SockStats + SOCK_WIFI);
+}
+
+static void fanout_send(uint8_t * buffer, int len)
+// Send a packet from the HL2 to each listener on its own socket. A listener that keeps its send buffer
+// full, or that stops sending, is dropped. The primary client has its own socket, so a slow listener
+// does not delay it. Call from the downlink thread only.
+{
+	struct s_listener * pt;
+	int i;
+	double dtime;
+
+	dtime = QuiskTimeSec();
+	pthread_mutex_lock(&listener_mutex);
+	for (i = 0; i < max_listeners; i++) {
+		pt = Listeners + i;
+		if (pt->addr.sin_addr.s_addr == 0 || pt->dropped)
+			continue;
+		if (dtime - pt->last_time > LISTENER_TIMEOUT || pt->busy > LISTENER_MAX_BUSY) {
+			if (DEBUG)
+				printf("Listener %s:%d dropped\n", inet_ntoa(pt->addr.sin_addr), ntohs(pt->addr.sin_port));
+			pt->dropped = true;	// the WiFi thread closes the socket
+			listeners_dropped++;
+			continue;
+		}
+		if (send(pt->sock, buffer, len, MSG_DONTWAIT) == len) {
+			if (pt->busy)
+				pt->busy--;
+			pt->sent++;
+		}
+		else {
+			pt->busy++;
+			pt->failed++;
 		}
 	}
+	pthread_mutex_unlock(&listener_mutex);
+}
+
+static void downlink_put(int port, uint8_t * buffer, int len, bool primary)
+// Queue a packet for the downlink thread. This never waits. Call from the HL2 thread only.
+{
+	struct s_downlink * slot;
+	unsigned int tail, depth;
+
+	if (len > BUFFER_SIZE)
+		return;
+	tail = __atomic_load_n(&dl_tail, __ATOMIC_ACQUIRE);
+	if (dl_head - tail >= DL_SLOTS) {	// full; drop the oldest packet unless the downlink thread just took it
+		if (__atomic_compare_exchange_n(&dl_tail, &tail, tail + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			dl_dropped++;
+	}
+	slot = Downlink + (dl_head & DL_MASK);
+	slot->port = port;
+	slot->primary = primary;
+	slot->len = len;
+	memcpy(slot->buf, buffer, len);
+	__atomic_store_n(&dl_head, dl_head + 1, __ATOMIC_RELEASE);
+	depth = dl_head - __atomic_load_n(&dl_tail, __ATOMIC_ACQUIRE);
+	if (dl_high_water < depth)
+		dl_high_water = depth;
+	sem_post(&dl_sem);
+}
+
+static void * downlink(void * arg)
+{  // Send packets from the HL2 to WiFi. A stalled WiFi socket delays this thread and not the HL2 thread.
+	uint8_t buffer[BUFFER_SIZE];
+	unsigned int tail;
+	int len, port;
+	int sock_rate = sample_rate, sock_receivers = num_receivers;
+	bool primary;
+	struct timespec ts;
+
+	while (1) {
+		if (sample_rate != sock_rate || num_receivers != sock_receivers) {	// resize the socket buffers
+			sock_rate = sample_rate;
+			sock_receivers = num_receivers;
+			size_socket_buffers();
+		}
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;		// wake up to check the sample rate when the queue is not used
+		if (sem_timedwait(&dl_sem, &ts) != 0)
+			continue;
+		tail = __atomic_load_n(&dl_tail, __ATOMIC_ACQUIRE);
+		if (tail == __atomic_load_n(&dl_head, __ATOMIC_ACQUIRE))
+			continue;
+		len = Downlink[tail & DL_MASK].len;
+		port = Downlink[tail & DL_MASK].port;
+		primary = Downlink[tail & DL_MASK].primary;
+		if (len > BUFFER_SIZE)
+			len = BUFFER_SIZE;
+		memcpy(buffer, Downlink[tail & DL_MASK].buf, len);
+		// If the HL2 thread dropped this packet, the copy may be damaged and is not sent.
+		if ( ! __atomic_compare_exchange_n(&dl_tail, &tail, tail + 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			continue;
+		if (port == 1024) {
+			if (primary)
+				wifi_send_1024(buffer, len);
+			if (listener_count && len == 1032 && buffer[3] == 0x06)	// listeners get the Rx samples
+				fanout_send(buffer, len);
+		}
+		else if (sendto(sock_wifi_1025, buffer, len, MSG_DONTWAIT, (struct sockaddr *)&sockaddr_in_client_1025, sizeof(struct sockaddr_in)) != len) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				dl_busy++;
+			else
+				perror("Forward 1025 from HL2");
+		}
+	}
+	return NULL;
+}
+
+#ifdef HL2_BPF
+static void bpf_stop(void)
+{  // Remove the programs so the kernel does not forward packets after we exit.
+	int i;
+
+	if (bpf_config)
+		__atomic_store_n(&bpf_config->enable, 0, __ATOMIC_RELEASE);
+	for (i = 0; i < 2; i++) {
+		if (bpf_hook[i].ifindex == 0)
+			continue;
+		bpf_opts[i].prog_fd = 0;
+		bpf_opts[i].prog_id = 0;
+		bpf_opts[i].flags = 0;
+		bpf_tc_detach(bpf_hook + i, bpf_opts + i);
+	}
+}
+
+static void bpf_start(void)
+{  // Load the kernel fast path and attach it to the HL2 and WiFi interfaces.
+	static const char * names[2] = {"hl2_ingress", "wifi_ingress"};
+	struct bpf_program * prog;
+	struct bpf_map * map;
+	long page;
+	int i, err;
+
+	if ( ! bpf_fast_path)
+		return;
+	if (wifi_iface2[0]) {
+		printf("The kernel fast path is not used with multipath\n");
+		return;
+	}
+	bpf_obj = bpf_object__open_file(HL2_BPF_OBJECT, NULL);
+	if ( ! bpf_obj) {
+		perror("Can't open " HL2_BPF_OBJECT);
+		return;
+	}
+	if (bpf_object__load(bpf_obj) != 0) {
+		perror("Can't load the kernel fast path");
+		bpf_object__close(bpf_obj);
+		return;
+	}
+	map = bpf_object__find_map_by_name(bpf_obj, "hl2_config");
+	page = sysconf(_SC_PAGESIZE);
+	bpf_config = mmap(NULL, (sizeof(struct hl2_bpf_config) + page - 1) / page * page,
+		PROT_READ | PROT_WRITE, MAP_SHARED, bpf_map__fd(map), 0);
+	if (bpf_config == MAP_FAILED) {
+		perror("Can't map the kernel fast path configuration");
+		bpf_config = NULL;
+		bpf_object__close(bpf_obj);
+		return;
+	}
+	bpf_stats_fd = bpf_map__fd(bpf_object__find_map_by_name(bpf_obj, "hl2_stats"));
+	atexit(bpf_stop);	// SIGINT and SIGTERM call exit() from wait_signal()
+	for (i = 0; i < 2; i++) {
+		memset(bpf_hook + i, 0, sizeof(struct bpf_tc_hook));
+		bpf_hook[i].sz = sizeof(struct bpf_tc_hook);
+		bpf_hook[i].ifindex = if_nametoindex(i ? wifi_iface : hl2_iface);
+		bpf_hook[i].attach_point = BPF_TC_INGRESS;
+		err = bpf_tc_hook_create(bpf_hook + i);
+		if (err && err != -EEXIST) {
+			fprintf(stderr, "Can't create the TC hook on %s: %s\n", i ? wifi_iface : hl2_iface, strerror(-err));
+			bpf_hook[i].ifindex = 0;
+			continue;
+		}
+		prog = bpf_object__find_program_by_name(bpf_obj, names[i]);
+		memset(bpf_opts + i, 0, sizeof(struct bpf_tc_opts));
+		bpf_opts[i].sz = sizeof(struct bpf_tc_opts);
+		bpf_opts[i].handle = 1;
+		bpf_opts[i].priority = 1;
+		bpf_opts[i].prog_fd = bpf_program__fd(prog);
+		bpf_opts[i].flags = BPF_TC_F_REPLACE;	// replace the program left by a previous run
+		err = bpf_tc_attach(bpf_hook + i, bpf_opts + i);
+		if (err) {
+			fprintf(stderr, "Can't attach the kernel fast path to %s: %s\n", i ? wifi_iface : hl2_iface, strerror(-err));
+			bpf_hook[i].ifindex = 0;
+		}
+	}
+	bpf_config->hl2_ifindex = if_nametoindex(hl2_iface);
+	bpf_config->wifi_ifindex = if_nametoindex(wifi_iface);
+	hl2_sequence_pt = &bpf_config->hl2_sequence;
+	if (DEBUG)
+		printf("Kernel fast path loaded\n");
+}
+
+static bool bpf_stats(unsigned long long counts[])
+{  // Add the per-CPU counts of the kernel fast path.
+	static int num_cpus = 0;
+	unsigned long long * values;
+	uint32_t key;
+	int i;
+
+	if ( ! bpf_config)
+		return false;
+	if (num_cpus == 0)
+		num_cpus = libbpf_num_possible_cpus();
+	values = calloc(num_cpus, sizeof(unsigned long long));
+	for (key = 0; key < HL2_BPF_STATS; key++) {
+		counts[key] = 0;
+		if (values && bpf_map_lookup_elem(bpf_stats_fd, &key, values) == 0)
+			for (i = 0; i < num_cpus; i++)
+				counts[key] += values[i];
+	}
+	free(values);
+	return true;
+}
+#else
+static void bpf_start(void) {}
+static bool bpf_stats(unsigned long long counts[]) { return false; }
+#endif
+
+static void bpf_update(void)
+{  // Give the current addresses to the kernel fast path. Call when the HL2 is started or stopped.
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	uint32_t enable = 0;
+
+	if ( ! bpf_config)
+		return;
+	__atomic_store_n(&bpf_config->enable, 0, __ATOMIC_RELEASE);
+	if ( ! hl2_running || sockaddr_in_hl2_1024.sin_addr.s_addr == 0 || sockaddr_in_client_1024.sin_addr.s_addr == 0)
+		return;
+	if (getsockname(sock_hl2, (struct sockaddr *)&addr, &len) != 0)
+		return;
+	if (bpf_config->hl2_addr != sockaddr_in_hl2_1024.sin_addr.s_addr)	// learn the MAC addresses again
+		__atomic_fetch_and(&bpf_config->macs, ~HL2_BPF_HL2_MAC, __ATOMIC_RELEASE);
+	if (bpf_config->client_addr != sockaddr_in_client_1024.sin_addr.s_addr)
+		__atomic_fetch_and(&bpf_config->macs, ~HL2_BPF_CLIENT_MAC, __ATOMIC_RELEASE);
+	bpf_config->hl2_addr = sockaddr_in_hl2_1024.sin_addr.s_addr;
+	bpf_config->hl2_host = hl2_hostaddr.s_addr;
+	bpf_config->hl2_host_port = addr.sin_port;
+	bpf_config->wifi_host = wifi_hostaddr.s_addr;
+	bpf_config->client_addr = sockaddr_in_client_1024.sin_addr.s_addr;
+	bpf_config->client_port = sockaddr_in_client_1024.sin_port;
+#ifdef HL2_BPF
+	if (bpf_hook[0].ifindex)	// the program on the HL2 interface is attached
+		enable |= HL2_BPF_DOWNLINK;
+	if (bpf_hook[1].ifindex && txbuf_used == 0)	// the Tx buffer needs every Tx packet
+		enable |= HL2_BPF_UPLINK;
+#endif
+	__atomic_store_n(&bpf_config->enable, enable, __ATOMIC_RELEASE);
+}
+
+static double primary_silent(double dtime)
+{  // Return the seconds since the last packet from the primary client, including Tx packets sent by the kernel fast path.
+	double silent = dtime - primary_time;
+	double kernel;
+	struct timespec ts;
+
+	if (bpf_config && (bpf_config->enable & HL2_BPF_UPLINK) && clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		kernel = ts.tv_sec + ts.tv_nsec * 1E-9 - __atomic_load_n(&bpf_config->client_time, __ATOMIC_RELAXED) * 1E-9;
+		if (silent > kernel)
+			silent = kernel;
+	}
+	return silent;
 }
 
 static void * read_wifi_1024(void * arg)
 {  // Data from WiFi that is copied to the HL2
 	uint8_t buffer[TX_BUF_BYTES];
 	struct sockaddr_in addr;
-	socklen_t sa_size;
-	int i, j, recv_len;
-	uint16_t index, above, below;
+	int j, recv_len, path;
 	bool send_rqst;
 	double dtime, delta;
 	static double time_jitter = 0;
@@ -168,8 +989,7 @@ static void * read_wifi_1024(void * arg)
 
 	while (1) {
 		// Read port 1024 from WiFi.
-		sa_size = sizeof(struct sockaddr_in);
-		recv_len = recvfrom(sock_wifi_1024, buffer, TX_BUF_BYTES, 0, (struct sockaddr *)&addr, &sa_size);
+		recv_len = recv_wifi_1024(buffer, TX_BUF_BYTES, &addr, &path);
 		if (recv_len <= 0) {
 			perror("Read WiFi");
 			continue;
@@ -178,6 +998,27 @@ static void * read_wifi_1024(void * arg)
 			continue;
 		wifi_up_bytes += recv_len + 14 + 20 + 8;	// add header bytes to data bytes
 		dtime = QuiskTimeSec();
+		if (max_listeners && hl2_running && sockaddr_in_client_1024.sin_addr.s_addr != 0 &&
+				(addr.sin_addr.s_addr != sockaddr_in_client_1024.sin_addr.s_addr || addr.sin_port != sockaddr_in_client_1024.sin_port)) {
+			if (buffer[0] == 0xEF && buffer[1] == 0xFE && buffer[2] == 4 && (buffer[3] & 0x01) &&
+					primary_silent(dtime) > PRIMARY_TIMEOUT) {
+				// The primary client went away without a Stop, or restarted on a new port. This client takes over.
+				if (DEBUG)
+					printf("Primary client %s:%d takes over\n", inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+				listener_remove(&addr);
+			}
+			else if (buffer[0] == 0xEF && buffer[1] == 0xFE && buffer[2] == 2) {	// discover from another client
+				if ( ! discover_reply(0, sock_wifi_1024, buffer, recv_len, &addr, dtime))
+					discover_forward(0, buffer, recv_len, &addr, dtime);
+				continue;
+			}
+			else {	// not the primary client
+				listener_packet(buffer, recv_len, &addr, dtime);
+				continue;
+			}
+		}
+		if (wifi_iface2[0] && ! multipath_receive(path, buffer, recv_len, &addr, dtime))	// duplicate from the other path
+			continue;
 		if (time_jitter == 0) {
 			time_jitter = dtime;
 			wifi_jitter = debug_jitter = 0;
@@ -209,32 +1050,29 @@ static void * read_wifi_1024(void * arg)
 			printf("\n");
 		}
 		sockaddr_in_client_1024 = addr;
+		primary_time = dtime;
 		if (buffer[2] == 2 && buffer[0] == 0xEF && buffer[1] == 0xFE) {	// Discover Packet
-			memset(&addr, 0, sizeof(struct sockaddr_in));
-			addr.sin_family = AF_INET;
-			addr.sin_port = htons(1024);
-			inet_aton("169.254.255.255", &addr.sin_addr);
-			if (sendto(sock_hl2, buffer, recv_len, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) != recv_len)
-				perror("Forward discover packet");
+			if ( ! discover_reply(0, sock_wifi_1024, buffer, recv_len, &addr, dtime))
+				discover_forward(0, buffer, recv_len, &addr, dtime);
 			continue;
 		}
 		else if (buffer[2] == 4 && buffer[0] == 0xEF && buffer[1] == 0xFE) {	// Start or Stop Packet
 			pthread_mutex_lock(&HL2_mutex);
+			hl2_running = buffer[3] & 0x01;
+			if (wifi_iface2[0] && (buffer[3] & 0x01))
+				multipath_reset();
+			if (max_listeners && ! hl2_running)	// the listeners stop with the primary client
+				listeners_clear();
+			recorder_event(REC_WIFI, EV_START, 0, buffer[3]);
 			num_receivers = 1;
 			time_jitter = 0;
 			sample_rate = 48000;
-			txbuf_started = STARTUP;
-			txbuf_read = 0;
-			txbuf_write = 0;
-			wifi_seq_duplicate = wifi_seq_out_of_order = wifi_seq_missing = 0;
-			for (i = 0; i < TX_BUF_COUNT; i++)
-				TxBuf[i].txbuf_state = EMPTY;
-			mox = 0;
+			txbuf_reset();
 			hl2_buffer_faults = 0;
-			wifi_buffer_overflow = wifi_buffer_underflow = 0;
 			wifi_up_bytes = wifi_down_bytes = 0;
-			HL2_sequence = 0;
+			__atomic_store_n(hl2_sequence_pt, 0, __ATOMIC_RELAXED);
 			pthread_mutex_unlock(&HL2_mutex);
+			bpf_update();
 			if (sockaddr_in_hl2_1024.sin_addr.s_addr != 0)
 				if (sendto(sock_hl2, buffer, recv_len, 0, (struct sockaddr *)&sockaddr_in_hl2_1024, sizeof(struct sockaddr_in)) != recv_len)
 					perror("Forward Start/Stop to HL2");
@@ -248,6 +1086,8 @@ static void * read_wifi_1024(void * arg)
 		}
 		// This is the I/Q transmit samples from WiFi on endpoint 2.
 		// The recv_len is 1032.
+		if (trace_name[0])	// arrival time, sequence number and mox for hl2_buffer_sim
+			trace_add(dtime, buffer);
 		if (txbuf_used == 0) {		// Tx buffer is not in use - just copy packet
 			read_C0(buffer);
 			replace_hl2_sequence(buffer);
@@ -256,55 +1096,7 @@ static void * read_wifi_1024(void * arg)
 					perror("Forward WiFi to HL2");
 			continue;
 		}
-		index = buffer[6] << 8 | buffer[7];	// 16-bit sequence
-		index &= TX_BUF_MASK;			// index into TxBuf
-		pthread_mutex_lock(&HL2_mutex);
-		if (TX_BUF_EMPTY) {
-			txbuf_read = txbuf_write = index;
-			if (++txbuf_write >= TX_BUF_COUNT) 
-				txbuf_write = 0;
-		}
-		else if (index == txbuf_write) {		// next index is in numerical order
-			if (++txbuf_write >= TX_BUF_COUNT) 
-				txbuf_write = 0;
-		}
-		else {
-			above = txbuf_fill(txbuf_write, index);
-			below = txbuf_fill(index, txbuf_write);
-			if (above < below) {	// index is above txbuf_write
-				if (DEBUG > 1)
-					printf("index above %d %d %d\n", above, txbuf_write, index);
-				txbuf_write = index;
-				if (++txbuf_write >= TX_BUF_COUNT) 
-					txbuf_write = 0;
-			}
-			else {		// index is below txbuf_write
-				wifi_seq_out_of_order++;
-				if (DEBUG > 1)
-					printf("index below %d %d %d\n", below, txbuf_write, index);
-				above = txbuf_fill(txbuf_read, index);
-				below = txbuf_fill(index, txbuf_read);
-				if (below < above) {	// index is below txbuf_read - discard
-					pthread_mutex_unlock(&HL2_mutex);
-					continue;
-				}
-			}
-		}
-		// copy the received packet in buffer to TxBuf[index]
-		if (TxBuf[index].txbuf_state == FILLED || TxBuf[index].txbuf_state == FILLED_RQST) {
-			if (DEBUG > 1)
-				printf("TxBuf collision at %d\n", index);
-			wifi_seq_duplicate++;
-		}
-		memcpy(TxBuf[index].buf, buffer, TX_BUF_BYTES);
-		if (buffer[11] & 0x80 || buffer[523] & 0x80) {	// The RQST bit is set
-			txbuf_send_rqst = index;
-			TxBuf[index].txbuf_state = FILLED_RQST;
-		}
-		else {
-			TxBuf[index].txbuf_state = FILLED;
-		}
-		pthread_mutex_unlock(&HL2_mutex);
+		txbuf_insert(buffer, dtime);
 	}
 	return NULL;
 }
@@ -313,24 +1105,25 @@ static void * read_hl2(void * arg)
 {  // Data from the HL2 that is copied to WiFi
 	uint8_t buffer[BUFFER_SIZE];
 	uint8_t * ptBuf;
-	static int txbuf_last_good = 0;
-	struct sockaddr_in addr;
-	socklen_t sa_size;
-	int i, recv_len, ratio;
+	struct sockaddr_in addr, client;
+	int recv_len, ratio;
 	uint8_t hl2_tx_fifo = 0;
 	static uint8_t hl2_tx_state = 0;
 	uint8_t C0_addr;
 	static double txbuf_time = 0;
 	double dtime;
+	bool discover, forwarded;
 
 	while (1) {
 		buffer[0] = 0;
-		sa_size = sizeof(struct sockaddr_in);
-		recv_len = recvfrom(sock_hl2, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&addr, &sa_size);
+		recv_len = recv_counted(sock_hl2, buffer, BUFFER_SIZE, &addr, NULL, SockStats + SOCK_HL2);
 		if (recv_len <= 0) {
 			perror("Read HL2");
 			continue;
 		}
+		forwarded = recv_len == 1032 && buffer[2] == (0x01 | HL2_BPF_FORWARDED);	// the kernel fast path sent it to WiFi
+		if (forwarded)
+			buffer[2] = 0x01;
 		if (hl2_hostaddr.s_addr == 0 ||  addr.sin_addr.s_addr == hl2_hostaddr.s_addr)	// reject broadcast packet
 			continue;
 		if (DEBUG > 1 && recv_len != 1032) {
@@ -352,6 +1145,8 @@ static void * read_hl2(void * arg)
 				}
 			}
 			if (C0_addr == 0) {	// check the HL2 internal error bit
+				if (hl2_tx_state)
+					recorder_event(REC_HL2, EV_FIFO, 0, hl2_tx_fifo);
 				switch (hl2_tx_state) {
 				case 0:			// mox is zero.
 				default:
@@ -378,6 +1173,7 @@ static void * read_hl2(void * arg)
 					else if (hl2_tx_fifo & 0x80) {
 						hl2_buffer_faults++;
 						hl2_tx_state = 3;
+						recorder_fault(EV_HL2_FAULT);
 						if (DEBUG > 1)
 							printf ("HL2 buffer fault: fifo 0x%X\n", hl2_tx_fifo);
 					}
@@ -395,38 +1191,36 @@ static void * read_hl2(void * arg)
 				}
 			}
 		}
+		discover = recv_len < 1032 && buffer[0] == 0xEF && buffer[1] == 0xFE && (buffer[2] == 2 || buffer[2] == 3);
 		if (ntohs(addr.sin_port) == 1025) {
 			sockaddr_in_hl2_1025 = addr;
+			if (discover && ! discover_save(1, buffer, recv_len, &addr, &client))	// reply to a cache refresh
+				continue;
 			wifi_down_bytes += recv_len + 14 + 20 + 8;	// add header bytes to data bytes
-			if (sendto(sock_wifi_1025, buffer, recv_len, 0, (struct sockaddr *)&sockaddr_in_client_1025, sizeof(struct sockaddr_in)) != recv_len)
-				perror("Forward 1025 from HL2");
+			downlink_put(1025, buffer, recv_len, true);
 			continue;
 		}
 		sockaddr_in_hl2_1024 = addr;
+		if (discover) {
+			if ( ! discover_save(0, buffer, recv_len, &addr, &client))	// reply to a cache refresh
+				continue;
+			if (client.sin_addr.s_addr != 0 && (client.sin_addr.s_addr != sockaddr_in_client_1024.sin_addr.s_addr ||
+					client.sin_port != sockaddr_in_client_1024.sin_port)) {	// a listener sent the discover
+				if (sendto(sock_wifi_1024, buffer, recv_len, 0, (struct sockaddr *)&client, sizeof(struct sockaddr_in)) != recv_len)
+					perror("Forward discover reply to listener");
+				continue;
+			}
+		}
 		wifi_down_bytes += recv_len + 14 + 20 + 8;	// add header bytes to data bytes
-		if (sendto(sock_wifi_1024, buffer, recv_len, 0, (struct sockaddr *)&sockaddr_in_client_1024, sizeof(struct sockaddr_in)) != recv_len)
-			perror("Forward 1024 from HL2");
+		if ( ! forwarded || listener_count)
+			downlink_put(1024, buffer, recv_len, ! forwarded);
+		recorder_freeze();	// also in pass-through, where faults come from the HL2
 		if (txbuf_used == 0)
 			continue;
 		// Send TxBuf samples to the HL2
 		ptBuf = NULL;
 		pthread_mutex_lock(&HL2_mutex);
-		if (txbuf_fill(txbuf_read, txbuf_write) > txbuf_used * 12 / 10) {	// check for overflow
-			int ignored = 0;
-			wifi_buffer_overflow++;
-			i = txbuf_read;
-			txbuf_read = txbuf_write - txbuf_used;
-			if (txbuf_read < 0)
-				txbuf_read += TX_BUF_COUNT;
-			while (i != txbuf_read) {	// change ignored records to EMPTY
-				TxBuf[i].txbuf_state = EMPTY;
-				ignored++;
-				if (++i >= TX_BUF_COUNT)
-					i = 0;
-			}
-			if (DEBUG)
-				printf("WiFi TxBuf overflow %d\n", ignored);
-		}
+		txbuf_check_overflow();
 		if (txbuf_started == STARTUP) {
 			hl2_rx_samples = 0;
 			txbuf_time = QuiskTimeSec();
@@ -436,8 +1230,9 @@ static void * read_hl2(void * arg)
 				ptBuf = buffer;
 				txbuf_send_rqst = -1;
 			}
-			if (txbuf_fill(txbuf_read, txbuf_write) >= txbuf_used) {
+			if (txbuf_fill(txbuf_read, txbuf_write) >= txbuf_start) {
 				txbuf_started = NORMAL;
+				recorder_event(REC_HL2, EV_STATE, 0, NORMAL);
 				if (DEBUG)
 					printf ("WiFi TxBuf Started\n");
 			}
@@ -448,68 +1243,7 @@ static void * read_hl2(void * arg)
 				ratio = sample_rate / 48000;		// send rate is 48 ksps
 				if (hl2_rx_samples / ratio >= 63 * 2) {	// Send a UDP packet
 					hl2_rx_samples -= 63 * 2 * ratio;
-					ptBuf = &TxBuf[txbuf_last_good].buf[0];
-					if (TX_BUF_EMPTY && txbuf_started == NORMAL) {
-						wifi_buffer_underflow++;
-						if (DEBUG)
-							printf("WiFi TxBuf underflow\n");
-						txbuf_started = RESTARTING;
-					}
-					if (txbuf_started == RESTARTING) {		// send the last packet again with zeroed Tx samples
-						if (TxBuf[txbuf_last_good].txbuf_state != ZEROED) {
-							TxBuf[txbuf_last_good].txbuf_state = ZEROED;
-							memset(TxBuf[txbuf_last_good].buf +  16, 0, 504);
-							memset(TxBuf[txbuf_last_good].buf + 528, 0, 504);
-						}
-						if (txbuf_fill(txbuf_read, txbuf_write) >= txbuf_used) {
-							txbuf_started = NORMAL;
-							if (DEBUG)
-								printf ("Wifi TxBuf underflow - restarting\n");
-						}
-					}
-					if (txbuf_started == NORMAL) {
-						if (TxBuf[txbuf_read].txbuf_state == FILLED_RQST) {
-							TxBuf[txbuf_read].txbuf_state = FILLED;
-							memcpy(&TxBuf[txbuf_read].buf[ 11], &TxBuf[txbuf_last_good].buf[ 11], 5);
-							memcpy(&TxBuf[txbuf_read].buf[523], &TxBuf[txbuf_last_good].buf[523], 5);
-						}
-						if (TxBuf[txbuf_read].txbuf_state == FILLED) {	 // send the buffer packet at txbuf_read to the HL2
-							TxBuf[txbuf_read].txbuf_state = EMPTY;
-							read_C0(TxBuf[txbuf_read].buf);
-							txbuf_last_good = txbuf_read;
-							ptBuf = &TxBuf[txbuf_last_good].buf[0];
-						}
-						else {		// send the last packet again with zeroed Tx samples
-							if (DEBUG > 1)
-								printf("Sending empty packet at %d\n", txbuf_read);
-							wifi_seq_missing++;
-							if (TxBuf[txbuf_last_good].txbuf_state != ZEROED) {
-								TxBuf[txbuf_last_good].txbuf_state = ZEROED;
-								memset(TxBuf[txbuf_last_good].buf +  16, 0, 504);
-								memset(TxBuf[txbuf_last_good].buf + 528, 0, 504);
-							}
-						}
-						if (++txbuf_read >= TX_BUF_COUNT)
-							txbuf_read = 0;
-					}
-					if (txbuf_send_rqst >= 0) {
-						// copy the packet we are sending to the HL2
-						memcpy(buffer, ptBuf, BUFFER_SIZE);
-						// copy C0-C4 to the packet
-						memcpy(buffer +  11, &TxBuf[txbuf_send_rqst].buf[ 11], 5);
-						memcpy(buffer + 523, &TxBuf[txbuf_send_rqst].buf[523], 5);
-						txbuf_send_rqst = -1;
-						// copy the prevailing mox bit to this out-of-order packet
-						if (mox) {
-							buffer[ 11] |= 0x01;
-							buffer[523] |= 0x01;
-						}
-						else {
-							buffer[ 11] &= 0xFE;
-							buffer[523] &= 0xFE;
-						}
-						ptBuf = buffer;
-					}
+					ptBuf = txbuf_tick(buffer, QuiskTimeSec());
 				}
 			}
 		}
@@ -536,11 +1270,16 @@ static void * webserver(void * arg)
 {
 	int sock_accept;
 	int valread, valwrite;
-	int fill;
+	int i, fill;
 	double util;
 	static double time_rates = 0;
 	double dtime;
 	char buffer[BUFFER_SIZE];
+	static struct s_recorder rings[2];
+	uint8_t fault;
+	double fault_time;
+	unsigned long long bpf_counts[HL2_BPF_STATS];
+	FILE * fp;
 	char * resp1 = "HTTP/1.0 200 OK\r\n"
 "Server: webserver-c\r\n"
 "Content-type: text/html\r\n\r\n"
@@ -568,6 +1307,10 @@ static void * webserver(void * arg)
 "<br>\r\n"
 "Internal buffer faults %d\r\n"
 "<br>\r\n"
+"Discover cache hits %u, misses %u\r\n"
+"<br>\r\n"
+"Discover response msec: cached %.2lf, forwarded %.1lf\r\n"
+"<br>\r\n"
 "<br>\r\n"
 ;
 
@@ -584,6 +1327,30 @@ static void * webserver(void * arg)
 "<br>\r\n"
 "Jitter msec %.0lf\r\n"
 "<br>\r\n"
+"Downlink queue %u, max %u, dropped %u, socket busy %u\r\n"
+"<br>\r\n"
+"<br>\r\n"
+;
+
+	char * resp3b =
+"<b>WiFi Path %s</b>\r\n"
+"<br>\r\n"
+"Packets %u, arrived first %u\r\n"
+"<br>\r\n"
+"Loss %.1lf%%, lag msec %.1lf\r\n"
+"<br>\r\n"
+"<br>\r\n"
+;
+
+	char * resp3c =
+"<b>Listeners</b>\r\n"
+"<br>\r\n"
+"Active %u of %d, dropped %u\r\n"
+"<br>\r\n"
+;
+
+	char * resp3d =
+"Listener %s:%d: sent %u, failed %u\r\n"
 "<br>\r\n"
 ;
 
@@ -597,6 +1364,23 @@ static void * webserver(void * arg)
 "Duplicate %u\r\n"
 "<br>\r\n"
 "<br>\r\n"
+;
+
+	char * resp4d =
+"<b>Kernel Socket Drops:</b>\r\n"
+"<br>\r\n"
+;
+
+	char * resp4c =
+"Socket %s: kernel drops %u, /proc drops %u\r\n"
+"<br>\r\n"
+"&nbsp;&nbsp;Queue max KB: receive %u of %d, send %u of %d\r\n"
+"<br>\r\n"
+;
+
+	char * resp4e =
+"Kernel fast path: to WiFi %llu, to HL2 %llu, no MAC %llu\r\n"
+"<br>\r\n"
 ;
 
 	char * resp4b =
@@ -618,6 +1402,14 @@ static void * webserver(void * arg)
 "<br>\r\n"
 "Overflow %d\r\n"
 "<br>\r\n"
+"Time to RF msec %.0lf, average %.0lf\r\n"
+"<br>\r\n"
+"Clock drift ppm %.1lf, samples inserted %u, removed %u\r\n"
+"<br>\r\n"
+"Control changes %u, msec to HL2 %.1lf, average %.1lf, resent %u\r\n"
+"<br>\r\n"
+"Flight recorder <a href=\"/recorder\">%u faults</a>\r\n"
+"<br>\r\n"
 ;
 
 	char * resp6 = 
@@ -639,6 +1431,28 @@ static void * webserver(void * arg)
 			close(sock_accept);
 			continue;
 		}
+		if (valread > 0 && strncmp(buffer, "GET /recorder", 13) == 0) {	// the flight recorder page
+			pthread_mutex_lock(&rec_mutex);
+			memcpy(rings, RecSnapshot, sizeof(rings));
+			fault = rec_snapshot_event;
+			fault_time = rec_snapshot_time;
+			pthread_mutex_unlock(&rec_mutex);
+			fp = fdopen(sock_accept, "w");
+			if (fp) {
+				fprintf(fp, "HTTP/1.0 200 OK\r\nServer: webserver-c\r\nContent-type: text/plain\r\n\r\n");
+				if (rec_snapshots)
+					recorder_print(fp, rings, fault, fault_time);
+				else
+					fprintf(fp, "No faults\n");
+				fflush(fp);
+				shutdown(sock_accept, SHUT_RDWR);
+				fclose(fp);
+			}
+			else {
+				close(sock_accept);
+			}
+			continue;
+		}
 		//printf("connection accepted %d\n", valread);
 		//printf("%s\n", buffer);
 		if (valread < 0) {
@@ -659,7 +1473,10 @@ static void * webserver(void * arg)
 		if (valwrite < 0)
 			perror("webserver (write)");
 		snprintf(buffer, BUFFER_SIZE, resp2,
-			hl2_iface[0] ? hl2_iface : "None", hl2_hostaddr.s_addr ? inet_ntoa(hl2_hostaddr) : "None", hl2_buffer_faults);
+			hl2_iface[0] ? hl2_iface : "None", hl2_hostaddr.s_addr ? inet_ntoa(hl2_hostaddr) : "None", hl2_buffer_faults,
+			discover_hits, discover_misses,
+			discover_hits ? discover_hit_time / discover_hits * 1E3 : 0.0,
+			discover_miss_replies ? discover_miss_time / discover_miss_replies * 1E3 : 0.0);
 		valwrite = write(sock_accept, buffer, strlen(buffer));
 		if (valwrite < 0)
 			perror("webserver (write)");
@@ -670,11 +1487,40 @@ static void * webserver(void * arg)
 		wifi_up_bytes = wifi_down_bytes = 0;
 		snprintf(buffer, BUFFER_SIZE, resp3,
 			wifi_iface, inet_ntoa(wifi_hostaddr),
-			wifi_up_rate, wifi_down_rate, wifi_jitter * 1E3);
+			wifi_up_rate, wifi_down_rate, wifi_jitter * 1E3,
+			dl_head - dl_tail, dl_high_water, dl_dropped, dl_busy);
 		wifi_jitter = 0;
 		valwrite = write(sock_accept, buffer, strlen(buffer));
 		if (valwrite < 0)
 			perror("webserver (write)");
+		for (i = 0; wifi_iface2[0] && i < 2; i++) {	// multipath statistics
+			struct s_path * pt = WifiPath + i;
+			double expected = pt->packets ? (double)(uint32_t)(pt->last_seq - pt->first_seq) + 1 : 0;
+			snprintf(buffer, BUFFER_SIZE, resp3b, i ? wifi_iface2 : wifi_iface, pt->packets, pt->wins,
+				expected > pt->packets ? (1.0 - pt->packets / expected) * 100.0 : 0.0,
+				pt->lag_count ? pt->lag_total / pt->lag_count * 1E3 : 0.0);
+			valwrite = write(sock_accept, buffer, strlen(buffer));
+			if (valwrite < 0)
+				perror("webserver (write)");
+		}
+		if (max_listeners) {	// fan-out statistics; no lock
+			snprintf(buffer, BUFFER_SIZE, resp3c, listener_count, max_listeners, listeners_dropped);
+			valwrite = write(sock_accept, buffer, strlen(buffer));
+			if (valwrite < 0)
+				perror("webserver (write)");
+			for (i = 0; i < max_listeners; i++) {
+				struct s_listener * pt = Listeners + i;
+				if (pt->addr.sin_addr.s_addr == 0)
+					continue;
+				snprintf(buffer, BUFFER_SIZE, resp3d, inet_ntoa(pt->addr.sin_addr), ntohs(pt->addr.sin_port), pt->sent, pt->failed);
+				valwrite = write(sock_accept, buffer, strlen(buffer));
+				if (valwrite < 0)
+					perror("webserver (write)");
+			}
+			valwrite = write(sock_accept, "<br>\r\n", 6);
+			if (valwrite < 0)
+				perror("webserver (write)");
+		}
 		if (txbuf_used) {
 			snprintf(buffer, BUFFER_SIZE, resp4a, wifi_seq_out_of_order, wifi_seq_missing, wifi_seq_duplicate);
 			valwrite = write(sock_accept, buffer, strlen(buffer));
@@ -686,7 +1532,33 @@ static void * webserver(void * arg)
 			if (valwrite < 0)
 				perror("webserver (write)");
 		}
-		snprintf(buffer, BUFFER_SIZE, resp5, delay, util, wifi_buffer_underflow, wifi_buffer_overflow);
+		valwrite = write(sock_accept, resp4d, strlen(resp4d));
+		if (valwrite < 0)
+			perror("webserver (write)");
+		for (i = 0; i < 3; i++) {	// kernel socket statistics
+			struct s_sock_stats * st = SockStats + i;
+			int sock = i == SOCK_HL2 ? sock_hl2 : (i == SOCK_WIFI ? sock_wifi_1024 : sock_wifi_1025);
+			snprintf(buffer, BUFFER_SIZE, resp4c, i == SOCK_HL2 ? "HL2" : (i == SOCK_WIFI ? "WiFi 1024" : "WiFi 1025"),
+				st->kernel_drops, proc_udp_drops(sock),
+				st->rx_queue_max / 1024, st->rcvbuf / 1024, st->tx_queue_max / 1024, st->sndbuf / 1024);
+			valwrite = write(sock_accept, buffer, strlen(buffer));
+			if (valwrite < 0)
+				perror("webserver (write)");
+		}
+		if (bpf_stats(bpf_counts)) {
+			snprintf(buffer, BUFFER_SIZE, resp4e, bpf_counts[HL2_BPF_STAT_DOWNLINK], bpf_counts[HL2_BPF_STAT_UPLINK],
+				bpf_counts[HL2_BPF_STAT_NO_MAC]);
+			valwrite = write(sock_accept, buffer, strlen(buffer));
+			if (valwrite < 0)
+				perror("webserver (write)");
+		}
+		valwrite = write(sock_accept, "<br>\r\n", 6);
+		if (valwrite < 0)
+			perror("webserver (write)");
+		snprintf(buffer, BUFFER_SIZE, resp5, delay, util, wifi_buffer_underflow, wifi_buffer_overflow,
+			keydown_last * 1E3, keydown_count ? keydown_total / keydown_count * 1E3 : 0.0,
+			drift_ppm, drift_inserted, drift_removed,
+			ctrl_count, ctrl_latency_last * 1E3, ctrl_count ? ctrl_latency_total / ctrl_count * 1E3 : 0.0, ctrl_resent, rec_snapshots);
 		valwrite = write(sock_accept, buffer, strlen(buffer));
 		if (valwrite < 0)
 			perror("webserver (write)");
@@ -705,6 +1577,7 @@ static void search_interfaces(int * delay, char wifi_iface[], char hl2_iface[],
 	FILE * fp;
 	char * s;
 	char line[BUFFER_SIZE];
+	int listeners = 0;
 
 	*delay = 300;
 	wifi_iface[0] = '\0';
@@ -723,11 +1596,27 @@ static void search_interfaces(int * delay, char wifi_iface[], char hl2_iface[],
 			if (strlen(line) < NAME_SIZE) {
 				sscanf(line, " hl2_interface = %s", hl2_iface);
 				sscanf(line, " wifi_interface = %s", wifi_iface);
+				sscanf(line, " wifi_interface2 = %s", wifi_iface2);
+				sscanf(line, " multipath_downlink = %d", &multipath_downlink);
 				sscanf(line, " buffer_milliseconds = %d", delay);
+				sscanf(line, " discovery_cache = %d", &discover_cache_enable);
+				sscanf(line, " keydown_milliseconds = %d", &keydown_delay);
+				sscanf(line, " drift_correction = %d", &drift_correct);
+				sscanf(line, " trace_file = %s", trace_name);
+				sscanf(line, " recorder_file = %s", recorder_name);
+				sscanf(line, " bpf_fast_path = %d", &bpf_fast_path);
+				sscanf(line, " control_fast_path = %d", &control_fast);
+				sscanf(line, " fanout_listeners = %d", &listeners);
 			}
 		}
 		fclose(fp);
 	}
+	// This is called again while waiting for the HL2 interface, so limit the value before other threads see it.
+	if (listeners > MAX_LISTENERS)
+		listeners = MAX_LISTENERS;
+	else if (listeners < 0 || wifi_iface2[0])	// fan-out is not used with multipath
+		listeners = 0;
+	max_listeners = listeners;
 	// search the interfaces for the names and addresses
 	if (getifaddrs(&ifap) == 0) {
 		p = ifap;
@@ -757,19 +1646,32 @@ static void search_interfaces(int * delay, char wifi_iface[], char hl2_iface[],
 	}
 }
 
+static void * wait_signal(void * arg)
+{  // SIGINT and SIGTERM are blocked in all other threads. Exit here so the atexit() functions run in a normal thread.
+	int sig;
+
+	if (sigwait((sigset_t *)arg, &sig) == 0) {
+		if (DEBUG)
+			printf("Exit on signal %d\n", sig);
+		exit(0);
+	}
+	return NULL;
+}
+
 int main()
 {
 	int one = 1;
 	int recv_len;
+	double dtime;
 	int dummy;
 	char dummy_iface[NAME_SIZE + 4];
 	struct in_addr dummy_hostaddr;
 	struct sockaddr_in addr;
-	pthread_t thr_wifi, thr_hl2, thr_webserver;
+	pthread_t thr_wifi, thr_hl2, thr_webserver, thr_recorder, thr_downlink, thr_signal, thr_trace;
+	static sigset_t signals;
 	struct timeval rtimeout = {1, 0};
-	char buffer[BUFFER_SIZE];
+	uint8_t buffer[BUFFER_SIZE];
 	bool started = false;
-	socklen_t sa_size;
 	memset(&sockaddr_in_client_1024, 0, sizeof(sockaddr_in_client_1024));
 	memset(&sockaddr_in_client_1025, 0, sizeof(sockaddr_in_client_1025));
 	memset(&sockaddr_in_hl2_1024, 0, sizeof(sockaddr_in_hl2_1024));
@@ -792,6 +1694,29 @@ int main()
 		txbuf_used = 0;
 	else if (txbuf_used < 8)	// 21 milliseconds minimum
 		txbuf_used = 8;
+	// For fast key-down, start sending with a small number of records.
+	if (txbuf_used && keydown_delay > 0) {
+		txbuf_keydown = (int)(keydown_delay / 2.625 + 0.5);
+		if (txbuf_keydown < 8)
+			txbuf_keydown = 8;
+		if (txbuf_keydown >= txbuf_used)
+			txbuf_keydown = 0;
+	}
+	txbuf_start = txbuf_keydown ? txbuf_keydown : txbuf_used;
+	if (trace_name[0]) {
+		trace_fp = fopen(trace_name, "w");
+		if ( ! trace_fp) {
+			perror("Can't open the trace file");
+			trace_name[0] = 0;
+		}
+	}
+	// Handle SIGINT and SIGTERM in one thread. Block them before any other thread is created.
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	if (pthread_create(&thr_signal, NULL, &wait_signal, &signals) != 0)
+		perror("Can't create signal thread");
 	if (DEBUG)
 		printf("delay %d TX_BUF_COUNT %d txbuf_used %d\n", delay, TX_BUF_COUNT, txbuf_used);
 	if (DEBUG)
@@ -814,6 +1739,14 @@ int main()
 		perror("webserver (listen)");
 	if (pthread_create(&thr_webserver, NULL, &webserver, NULL) != 0)
 		perror("Can't create webserver thread");
+	if (recorder_name[0])
+		if (pthread_create(&thr_recorder, NULL, &recorder_writer, NULL) != 0)
+			perror("Can't create recorder thread");
+	if (trace_fp) {
+		atexit(trace_close);	// SIGINT and SIGTERM call exit() from wait_signal()
+		if (pthread_create(&thr_trace, NULL, &trace_writer, NULL) != 0)
+			perror("Can't create trace thread");
+	}
 	//Create two UDP sockets for the WiFi interface
 	sock_wifi_1024 = socket(AF_INET, SOCK_DGRAM, 0);
 	sock_wifi_1025 = socket(AF_INET, SOCK_DGRAM, 0);
@@ -829,6 +1762,18 @@ int main()
 	//	perror("setsockopt timeout for sock_wifi_1024 failed");
 	if (setsockopt(sock_wifi_1025, SOL_SOCKET, SO_BROADCAST, (char*)&one, sizeof(one)) != 0)
 		perror("setsockopt broadcast for sock_wifi_1025 failed");
+	if (setsockopt(sock_wifi_1024, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) != 0)
+		perror("setsockopt drop count for sock_wifi_1024 failed");
+	if (setsockopt(sock_wifi_1025, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) != 0)
+		perror("setsockopt drop count for sock_wifi_1025 failed");
+	if (wifi_iface2[0]) {	// multipath; find the interface for each packet
+		wifi_ifindex[0] = if_nametoindex(wifi_iface);
+		wifi_ifindex[1] = if_nametoindex(wifi_iface2);
+		if (wifi_ifindex[1] == 0)
+			perror("Can't find wifi_interface2");
+		if (setsockopt(sock_wifi_1024, IPPROTO_IP, IP_PKTINFO, &one, sizeof(one)) != 0)
+			perror("setsockopt pktinfo for sock_wifi_1024 failed");
+	}
 	memset(&addr, 0, sizeof(addr));
 	addr.sin_family = AF_INET;
 	addr.sin_port = htons(1024);
@@ -867,8 +1812,15 @@ int main()
 					close(sock_hl2);
 					perror("Failed to bind the HL2 socket");
 				}
+				if (setsockopt(sock_hl2, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one)) != 0)
+					perror("setsockopt drop count for sock_hl2 failed");
+				size_socket_buffers();
+				bpf_start();
 				if (pthread_create(&thr_wifi, NULL, &read_wifi_1024, NULL) != 0)
 					perror("Can't create WiFi thread");
+				sem_init(&dl_sem, 0, 0);
+				if (pthread_create(&thr_downlink, NULL, &downlink, NULL) != 0)
+					perror("Can't create downlink thread");
 				if (pthread_create(&thr_hl2, NULL, &read_hl2, NULL) != 0)
 					perror("Can't create HL2 thread");
 			}
@@ -881,8 +1833,7 @@ int main()
 			}
 		}
 		// Accept incoming connections from WiFi port 1025
-		sa_size = sizeof(struct sockaddr_in);
-		recv_len = recvfrom(sock_wifi_1025, buffer, BUFFER_SIZE, 0, (struct sockaddr *)&addr, &sa_size);
+		recv_len = recv_counted(sock_wifi_1025, buffer, BUFFER_SIZE, &addr, NULL, SockStats + SOCK_1025);
 		if (recv_len <= 0) {
 			perror("Read WiFi 1025");
 			continue;
@@ -898,12 +1849,9 @@ int main()
 		}
 		sockaddr_in_client_1025 = addr;
 		if (buffer[2] == 2 && buffer[0] == 0xEF && buffer[1] == 0xFE) {	// Discover Packet
-			memset(&addr, 0, sizeof(struct sockaddr_in));
-			addr.sin_family = AF_INET;
-			addr.sin_port = htons(1025);
-			inet_aton("169.254.255.255", &addr.sin_addr);
-			if (sendto(sock_hl2, buffer, recv_len, 0, (struct sockaddr *)&addr, sizeof(struct sockaddr_in)) != recv_len)
-				perror("Forward discover packet port 1025");
+			dtime = QuiskTimeSec();
+			if ( ! discover_reply(1, sock_wifi_1025, buffer, recv_len, &addr, dtime))
+				discover_forward(1, buffer, recv_len, &addr, dtime);
 		}
 		else {
 			if (sockaddr_in_hl2_1025.sin_addr.s_addr != 0)
@@ -0,0 +1,758 @@
+// This software is Copyright (C) 2023-2024 by James C. Ahlstrom.
+// This free software is licensed for use under the GNU General Public
+// License (GPL), see http://www.opensource.org.
+// Note that there is NO WARRANTY AT ALL.  USE AT YOUR OWN RISK!!
+
+// The Tx buffer of hl2_wifi_buffer. Tx packets from WiFi are saved in TxBuf by their sequence number,
+// and sent to the HL2 at the HL2 sample rate. See txbuf.h.
+
+#include <string.h>
+#include <time.h>
+#include "txbuf.h"
+
+// Clock drift correction.
+#define DRIFT_WINDOW	3810	// packets (10 seconds) between drift estimates
+#define DRIFT_CENTER	30.0	// seconds to move the buffer fill back to txbuf_used
+
+// C0 addresses below CTRL_ADDRS are registers. Higher addresses are commands such as I2C writes.
+// The registers in CTRL_FAST are sent to the HL2 when they change, ahead of the buffered samples. These are the
+// Tx and Rx frequencies (addresses 1 to 8) and the attenuator (0x0A). Other registers change the RF path, such as
+// the Tx antenna in address 0 and the drive level and PA in address 9, and stay with the samples like the commands.
+// The Tx frequency also stays with the samples during transmit.
+#define CTRL_ADDRS	0x38
+#define CTRL_FAST	(0x1FEull | 1ull << 0x0A)
+#define CTRL_TX_FREQ	0x01
+// Frames of packets that are discarded or merged are not lost. Their commands wait in a queue of CTRL_CMDS,
+// and they and their registers replace later frames that repeat a register the HL2 already has.
+#define CTRL_CMDS	16
+
+int mox = 0;
+uint8_t num_receivers = 1;
+int sample_rate = 48000;
+int txbuf_read = 0;
+int txbuf_write = 0;
+int txbuf_send_rqst = -1;
+int txbuf_used;
+int txbuf_start;		// start sending when the buffer has this many records
+int txbuf_keydown = 0;	// buffer records during receive for fast key-down, or zero
+int txbuf_last_good = 0;
+static int txbuf_carry_n = 0;	// number of I/Q samples in txbuf_carry
+static uint8_t txbuf_carry[TX_SAMPLES * 8];	// samples left over after a sample was inserted or removed
+static uint8_t txbuf_out[BUFFER_SIZE];
+static double keydown_time = 0;	// arrival time of the first WiFi packet with mox, or zero
+double keydown_last = 0;	// the most recent time to RF
+double keydown_total = 0;
+unsigned int keydown_count = 0;
+int drift_correct = 1;		// drift correction from the configuration file
+static int txbuf_drift_reset = 2;	// 1: restart the drift measurement; 2: also forget the estimate
+double drift_ppm = 0;		// estimated client rate minus HL2 rate in parts per million
+unsigned int drift_inserted = 0;
+unsigned int drift_removed = 0;
+static bool wifi_mox = false;		// the mox bit of the last packet from WiFi
+int control_fast = 1;		// control fast path from the configuration file
+static uint8_t ctrl_shadow[CTRL_ADDRS][4];	// the newest C1-C4 from WiFi for each C0 address
+static uint64_t ctrl_known = 0;		// a bit for each address in ctrl_shadow
+static uint64_t ctrl_pending = 0;	// a bit for each address that changed and was not yet sent
+static double ctrl_time[CTRL_ADDRS];	// arrival time of the change
+static uint8_t ctrl_sent[CTRL_ADDRS][4];	// the C1-C4 last sent to the HL2 for each C0 address
+static uint64_t ctrl_sent_known = 0;
+static uint8_t ctrl_lost[CTRL_ADDRS][4];	// registers from packets that were not sent
+static uint64_t ctrl_lost_bits = 0;
+static uint8_t ctrl_cmds[CTRL_CMDS][5];	// C0-C4 of commands from packets that were not sent
+static int ctrl_cmd_head = 0;
+static int ctrl_cmd_count = 0;
+unsigned int ctrl_resent = 0;	// frames of packets that were not sent, sent later
+double ctrl_latency_last = 0;	// the most recent time from WiFi to the HL2 for a changed register
+double ctrl_latency_total = 0;
+unsigned int ctrl_count = 0;
+unsigned int wifi_buffer_overflow = 0;
+unsigned int wifi_buffer_underflow = 0;
+uint16_t wifi_seq_duplicate;
+uint16_t wifi_seq_out_of_order;
+uint16_t wifi_seq_missing;
+pthread_mutex_t HL2_mutex = PTHREAD_MUTEX_INITIALIZER;
+enum _txbuf_started txbuf_started;
+struct s_txbuf TxBuf[TX_BUF_COUNT];
+
+static const char * rec_event_names[] = {"Start", "Insert", "Late", "Discard", "Duplicate", "Rqst", "RqstSent",
+	"Dequeue", "Missing", "Adjust", "State", "Mox", "Fifo", "Underflow", "Overflow", "HL2Fault", "Control"};
+
+struct s_recorder Recorder[2], RecSnapshot[2];	// the live rings, and the rings saved at the last fault
+static double rec_fault_time = 0;	// time of a fault waiting to be saved, or zero
+static uint8_t rec_fault_event;
+uint8_t rec_snapshot_event;	// the fault in RecSnapshot
+double rec_snapshot_time;
+unsigned int rec_snapshots = 0;	// number of faults saved
+char recorder_name[NAME_SIZE + 4];	// append the saved events to this file
+pthread_mutex_t rec_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t rec_cond = PTHREAD_COND_INITIALIZER;
+
+double QuiskTimeSec(void)
+{
+	struct timespec ts;
+#ifdef CLOCK_MONOTONIC_RAW
+	if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts) != 0)
+#else
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+#endif
+		return 0;
+	return (double)ts.tv_sec + ts.tv_nsec * 1E-9;
+}
+
+void recorder_fault(uint8_t event)
+// Record a fault. The rings are saved REC_AFTER seconds later. Call from the HL2 thread.
+{
+	recorder_event(REC_HL2, event, 0, 0);
+	if (rec_fault_time == 0) {
+		rec_fault_time = QuiskTimeSec();
+		rec_fault_event = event;
+	}
+}
+
+void recorder_freeze(void)
+// Save the rings if a fault was recorded long enough ago. Call from the HL2 thread.
+{
+	if (rec_fault_time == 0 || QuiskTimeSec() - rec_fault_time < REC_AFTER)
+		return;
+	if (pthread_mutex_trylock(&rec_mutex) != 0)	// never wait; try again on the next packet
+		return;
+	RecSnapshot[REC_WIFI].head = __atomic_load_n(&Recorder[REC_WIFI].head, __ATOMIC_ACQUIRE);
+	RecSnapshot[REC_HL2].head = Recorder[REC_HL2].head;
+	memcpy(RecSnapshot[REC_WIFI].events, Recorder[REC_WIFI].events, sizeof(Recorder[0].events));
+	memcpy(RecSnapshot[REC_HL2].events, Recorder[REC_HL2].events, sizeof(Recorder[0].events));
+	rec_snapshot_time = rec_fault_time;
+	rec_snapshot_event = rec_fault_event;
+	rec_snapshots++;
+	rec_fault_time = 0;
+	pthread_cond_signal(&rec_cond);
+	pthread_mutex_unlock(&rec_mutex);
+}
+
+void recorder_print(FILE * fp, struct s_recorder rings[], uint8_t fault, double fault_time)
+// Print the events in the two rings in time order. Times are milliseconds from the fault.
+{
+	struct s_rec_event * ev;
+	unsigned int index[2], end[2];
+	int i, ring;
+
+	fprintf(fp, "Fault %s; %u faults saved\n", rec_event_names[fault], rec_snapshots);
+	fprintf(fp, "    msec Thread Event       Seq  Fill  Arg\n");
+	for (i = 0; i < 2; i++) {
+		end[i] = rings[i].head;
+		// skip the oldest events, which may have been overwritten during the copy
+		index[i] = end[i] > REC_SIZE - 64 ? end[i] - (REC_SIZE - 64) : 0;
+	}
+	while (index[0] < end[0] || index[1] < end[1]) {
+		if (index[0] >= end[0])
+			ring = 1;
+		else if (index[1] >= end[1])
+			ring = 0;
+		else
+			ring = rings[0].events[index[0] & REC_MASK].time <= rings[1].events[index[1] & REC_MASK].time ? 0 : 1;
+		ev = rings[ring].events + (index[ring]++ & REC_MASK);
+		if (ev->event > EV_CONTROL)
+			continue;
+		fprintf(fp, "%8.1lf %-6s %-10s %5u %5u %4d\n", (ev->time - fault_time) * 1E3, ring == REC_WIFI ? "WiFi" : "HL2",
+			rec_event_names[ev->event], ev->seq, ev->fill, ev->event == EV_ADJUST ? (int8_t)ev->arg : ev->arg);
+	}
+}
+
+void * recorder_writer(void * arg)
+{  // Append each saved fault to the recorder file.
+	static struct s_recorder rings[2];
+	unsigned int written = 0;
+	uint8_t fault;
+	double fault_time;
+	FILE * fp;
+
+	pthread_mutex_lock(&rec_mutex);
+	while (1) {
+		while (written == rec_snapshots)
+			pthread_cond_wait(&rec_cond, &rec_mutex);
+		written = rec_snapshots;
+		memcpy(rings, RecSnapshot, sizeof(rings));
+		fault = rec_snapshot_event;
+		fault_time = rec_snapshot_time;
+		pthread_mutex_unlock(&rec_mutex);
+		fp = fopen(recorder_name, "a");
+		if (fp) {
+			recorder_print(fp, rings, fault, fault_time);
+			fprintf(fp, "\n");
+			fclose(fp);
+		}
+		else {
+			perror("Can't open the recorder file");
+		}
+		pthread_mutex_lock(&rec_mutex);
+	}
+	return NULL;
+}
+
+void read_C0(uint8_t buffer[])
+{
+	uint8_t C0_addr, speed;
+
+	mox = buffer[11] & 0x01;
+	C0_addr = (buffer[11] >> 1) & 0x3F;
+	if (C0_addr == 0) {
+		speed = buffer[12] & 0x03;
+		num_receivers = ((buffer[15] >> 3) & 0x0F) + 1;
+	}
+	else {
+		C0_addr = (buffer[523] >> 1) & 0x3F;
+		if (C0_addr == 0) {
+			speed = buffer[524] & 0x03;
+			num_receivers = ((buffer[527] >> 3) & 0x0F) + 1;
+		}
+	}
+	if (C0_addr == 0) {
+		switch (speed) {
+		case 0:
+		default:
+			sample_rate = 48000;
+			break;
+		case 1:
+			sample_rate = 96000;
+			break;
+		case 2:
+			sample_rate = 192000;
+			break;
+		case 3:
+			sample_rate = 384000;
+			break;
+		}
+	}
+}
+
+static void control_arrival(uint8_t * buffer, double dtime)
+// Save the fast C&C registers of a Tx packet from WiFi and note the ones that changed. Call with HL2_mutex locked.
+{
+	int i, offset;
+	uint8_t addr;
+	uint64_t bit;
+
+	for (i = 0; i < 2; i++) {
+		offset = i ? 523 : 11;
+		addr = (buffer[offset] >> 1) & 0x3F;
+		bit = (uint64_t)1 << addr;
+		if (addr >= CTRL_ADDRS || ! (CTRL_FAST & bit))
+			continue;
+		// A RQST frame is already sent early by txbuf_send_rqst.
+		if ((ctrl_known & bit) && ! (buffer[offset] & 0x80) && memcmp(ctrl_shadow[addr], buffer + offset + 1, 4) != 0) {
+			if ( ! (ctrl_pending & bit))
+				ctrl_time[addr] = dtime;
+			ctrl_pending |= bit;
+		}
+		memcpy(ctrl_shadow[addr], buffer + offset + 1, 4);
+		ctrl_known |= bit;
+	}
+}
+
+static void control_splice(uint8_t * buffer, double dtime)
+// Put the newest fast C&C registers into this packet to the HL2. A changed register replaces a fast register
+// frame, or a frame that repeats a value the HL2 already has, and the other fast register frames are updated
+// so an older value is never sent. The mox bit, commands and other registers stay with the samples.
+// Call with HL2_mutex locked.
+{
+	int i, offset;
+	uint8_t addr;
+	uint64_t bit, fast;
+
+	fast = CTRL_FAST;
+	if (buffer[11] & 0x01)	// transmit; the Tx frequency stays with the samples
+		fast &= ~((uint64_t)1 << CTRL_TX_FREQ);
+	for (i = 0; i < 2; i++) {
+		offset = i ? 523 : 11;
+		addr = (buffer[offset] >> 1) & 0x3F;
+		if (buffer[offset] & 0x80 || addr >= CTRL_ADDRS)	// leave RQST frames and commands alone
+			continue;
+		bit = (uint64_t)1 << addr;
+		if ( ! (fast & bit)) {
+			if ((ctrl_pending & bit) && memcmp(ctrl_shadow[addr], buffer + offset + 1, 4) == 0)
+				ctrl_pending &= ~bit;	// the held Tx frequency was sent with the samples
+			if ( ! (ctrl_pending & fast) || ! (ctrl_sent_known & bit) || memcmp(ctrl_sent[addr], buffer + offset + 1, 4) != 0)
+				continue;
+		}
+		else if ( ! (ctrl_known & bit)) {
+			continue;
+		}
+		if (ctrl_pending & fast) {
+			if ( ! (ctrl_pending & fast & bit))
+				addr = __builtin_ctzll(ctrl_pending & fast);
+			ctrl_pending &= ~((uint64_t)1 << addr);
+			buffer[offset] = addr << 1 | (buffer[offset] & 0x01);
+			ctrl_latency_last = dtime - ctrl_time[addr];
+			ctrl_latency_total += ctrl_latency_last;
+			ctrl_count++;
+			recorder_event(REC_HL2, EV_CONTROL, 0, addr);
+		}
+		memcpy(buffer + offset + 1, ctrl_shadow[addr], 4);
+	}
+	read_C0(buffer);	// the sample rate and receivers the HL2 now uses
+}
+
+static int control_cmd_frames(uint8_t * buffer)
+// Return the number of command frames in a packet.
+{
+	return (((buffer[11] >> 1) & 0x3F) >= CTRL_ADDRS) + (((buffer[523] >> 1) & 0x3F) >= CTRL_ADDRS);
+}
+
+static void control_lost(uint8_t * buffer)
+// Save the C&C frames of a FILLED record that will not be sent because it is discarded or merged with the
+// next record. Its samples are gone, but its commands and registers must reach the HL2. Call with HL2_mutex locked.
+{
+	int i, offset;
+	uint8_t addr;
+	uint64_t bit;
+
+	for (i = 0; i < 2; i++) {
+		offset = i ? 523 : 11;
+		addr = (buffer[offset] >> 1) & 0x3F;
+		if (addr >= CTRL_ADDRS) {
+			if (ctrl_cmd_count < CTRL_CMDS) {
+				memcpy(ctrl_cmds[(ctrl_cmd_head + ctrl_cmd_count) % CTRL_CMDS], buffer + offset, 5);
+				ctrl_cmd_count++;
+			}
+			continue;
+		}
+		bit = (uint64_t)1 << addr;
+		if (control_fast && (CTRL_FAST & bit) && addr != CTRL_TX_FREQ)	// control_splice() has the newest value
+			continue;
+		if ((ctrl_sent_known & bit) && memcmp(ctrl_sent[addr], buffer + offset + 1, 4) == 0) {
+			ctrl_lost_bits &= ~bit;		// the HL2 has this value
+			continue;
+		}
+		memcpy(ctrl_lost[addr], buffer + offset + 1, 4);
+		ctrl_lost_bits |= bit;
+	}
+}
+
+static void control_resend(uint8_t * buffer)
+// Replace frames that repeat a register the HL2 already has with the saved commands and registers from
+// packets that were not sent. Then record the registers sent. Call for each packet to the HL2 with HL2_mutex locked.
+{
+	int i, offset;
+	uint8_t addr;
+	uint64_t bit;
+	bool changed = false;
+
+	for (i = 0; i < 2; i++) {
+		offset = i ? 523 : 11;
+		if (buffer[offset] & 0x80)	// leave RQST frames alone
+			continue;
+		addr = (buffer[offset] >> 1) & 0x3F;
+		bit = (uint64_t)1 << addr;
+		if ((ctrl_cmd_count || ctrl_lost_bits) && addr < CTRL_ADDRS && (ctrl_sent_known & bit) &&
+				memcmp(ctrl_sent[addr], buffer + offset + 1, 4) == 0) {	// this frame is not needed
+			if (ctrl_cmd_count) {
+				memcpy(buffer + offset, ctrl_cmds[ctrl_cmd_head], 5);
+				buffer[offset] = (buffer[offset] & 0xFE) | (buffer[11] & 0x01);	// keep the mox bit
+				ctrl_cmd_head = (ctrl_cmd_head + 1) % CTRL_CMDS;
+				ctrl_cmd_count--;
+			}
+			else {
+				addr = __builtin_ctzll(ctrl_lost_bits);
+				buffer[offset] = addr << 1 | (buffer[11] & 0x01);
+				memcpy(buffer + offset + 1, ctrl_lost[addr], 4);
+			}
+			ctrl_resent++;
+			changed = true;
+			addr = (buffer[offset] >> 1) & 0x3F;
+		}
+		if (addr < CTRL_ADDRS) {
+			bit = (uint64_t)1 << addr;
+			memcpy(ctrl_sent[addr], buffer + offset + 1, 4);
+			ctrl_sent_known |= bit;
+			ctrl_lost_bits &= ~bit;		// a newer value was sent
+		}
+	}
+	if (changed)
+		read_C0(buffer);
+}
+
+static uint8_t * txbuf_dequeue(void)
+// Remove the record at txbuf_read and return the packet to send. Call with HL2_mutex locked.
+// If the record is missing, return the last good packet with zeroed Tx samples.
+{
+	if (TxBuf[txbuf_read].txbuf_state == FILLED_RQST) {
+		TxBuf[txbuf_read].txbuf_state = FILLED;
+		memcpy(&TxBuf[txbuf_read].buf[ 11], &TxBuf[txbuf_last_good].buf[ 11], 5);
+		memcpy(&TxBuf[txbuf_read].buf[523], &TxBuf[txbuf_last_good].buf[523], 5);
+	}
+	if (TxBuf[txbuf_read].txbuf_state == FILLED) {	 // send the buffer packet at txbuf_read to the HL2
+		TxBuf[txbuf_read].txbuf_state = EMPTY;
+		read_C0(TxBuf[txbuf_read].buf);
+		txbuf_last_good = txbuf_read;
+		recorder_event(REC_HL2, EV_DEQUEUE, TxBuf[txbuf_read].buf[6] << 8 | TxBuf[txbuf_read].buf[7], 0);
+	}
+	else {		// send the last packet again with zeroed Tx samples
+		if (DEBUG > 1)
+			printf("Sending empty packet at %d\n", txbuf_read);
+		wifi_seq_missing++;
+		recorder_event(REC_HL2, EV_MISSING, txbuf_read, 0);
+		if (TxBuf[txbuf_last_good].txbuf_state != ZEROED) {
+			TxBuf[txbuf_last_good].txbuf_state = ZEROED;
+			memset(TxBuf[txbuf_last_good].buf +  16, 0, 504);
+			memset(TxBuf[txbuf_last_good].buf + 528, 0, 504);
+		}
+	}
+	if (++txbuf_read >= TX_BUF_COUNT)
+		txbuf_read = 0;
+	return &TxBuf[txbuf_last_good].buf[0];
+}
+
+static uint8_t * txbuf_adjust(int adjust)
+// Return the next packet to send with one I/Q sample inserted (adjust > 0) or removed (adjust < 0).
+// The packet is resampled with linear interpolation, so a repeated or skipped sample does not make spurs.
+// Left over samples are kept in txbuf_carry so the sample stream stays continuous, and
+// records are removed from the buffer as needed. The samples of a packet all have the mox bit
+// of its header, so the carry is sent or discarded when mox changes. Call with HL2_mutex locked.
+{
+	uint8_t stream[TX_SAMPLES * 3 * 8];	// the carry plus up to two packets
+	uint8_t * pkt = &TxBuf[txbuf_last_good].buf[0];
+	uint8_t * merged = NULL;
+	uint8_t * pt;
+	int i, k, n, need, pos, frac, a, b, value;
+
+	if (adjust < 0 && txbuf_fill(txbuf_read, txbuf_write) < 2)
+		adjust = 0;
+	need = TX_SAMPLES - adjust;	// number of input samples used for this packet
+	n = txbuf_carry_n;
+	memcpy(stream, txbuf_carry, n * 8);
+	while (n < need + (adjust != 0)) {	// interpolation needs the next sample too
+		pt = TxBuf[txbuf_read].buf;
+		if (n && TxBuf[txbuf_read].txbuf_state == FILLED && (pt[11] & 0x01) != mox) {	// mox changes at the next record
+			if ( ! mox) {	// key down; the Rx samples are not sent
+				n = 0;
+				continue;
+			}
+			// Key up; send the rest of the Tx samples with mox, followed by zero samples.
+			memcpy(txbuf_out, pkt, TX_BUF_BYTES);
+			for (i = 0; i < TX_SAMPLES; i++) {
+				if (i < n)
+					memcpy(txbuf_out + TX_SAMPLE_OFFSET(i), stream + i * 8, 8);
+				else
+					memset(txbuf_out + TX_SAMPLE_OFFSET(i), 0, 8);
+			}
+			txbuf_carry_n = 0;
+			return txbuf_out;
+		}
+		if (merged)	// only the C&C of the newest packet is sent
+			control_lost(merged);
+		merged = TxBuf[txbuf_read].txbuf_state == FILLED ? TxBuf[txbuf_read].buf : NULL;
+		pkt = txbuf_dequeue();
+		for (i = 0; i < TX_SAMPLES; i++)
+			memcpy(stream + (n + i) * 8, pkt + TX_SAMPLE_OFFSET(i), 8);
+		n += TX_SAMPLES;
+	}
+	memcpy(txbuf_out, pkt, TX_BUF_BYTES);	// header and C0-C4 from the newest packet
+	for (i = 0; i < TX_SAMPLES; i++) {
+		pt = txbuf_out + TX_SAMPLE_OFFSET(i);
+		pos = i * need;		// input position times TX_SAMPLES
+		frac = pos % TX_SAMPLES;
+		pos /= TX_SAMPLES;
+		if (frac == 0) {
+			memcpy(pt, stream + pos * 8, 8);
+			continue;
+		}
+		for (k = 0; k < 8; k += 2) {	// L, R, I and Q are 16-bit big-endian
+			a = (int16_t)(stream[pos * 8 + k] << 8 | stream[pos * 8 + k + 1]);
+			b = (int16_t)(stream[pos * 8 + 8 + k] << 8 | stream[pos * 8 + 8 + k + 1]);
+			value = a + (b - a) * frac / TX_SAMPLES;
+			pt[k] = value >> 8 & 0xFF;
+			pt[k + 1] = value & 0xFF;
+		}
+	}
+	if (adjust)
+		recorder_event(REC_HL2, EV_ADJUST, 0, adjust);
+	txbuf_carry_n = n - need;
+	memcpy(txbuf_carry, stream + need * 8, txbuf_carry_n * 8);
+	return txbuf_out;
+}
+
+static int txbuf_keydown_adjust(void)
+// Fast key-down: keep the buffer at txbuf_keydown records during receive so that the first
+// packet with mox is sent quickly. During transmit, grow the buffer to txbuf_used by inserting
+// a sample into each packet. Return the adjustment for txbuf_adjust(). Call with HL2_mutex locked.
+{
+	int fill;
+	uint8_t * pt;
+
+	if (txbuf_keydown == 0)
+		return 0;
+	fill = txbuf_fill(txbuf_read, txbuf_write);
+	if (mox)
+		return fill < txbuf_used ? 1 : 0;
+	// The HL2 is receiving and the Tx samples are not used. Discard the carry, and discard one
+	// record if the buffer is above the key-down level. Keep records with mox or the RQST bit, and
+	// records with commands when the command queue is full. The C&C of a discarded record is sent later.
+	txbuf_carry_n = 0;
+	if (fill > txbuf_keydown + 1) {
+		pt = TxBuf[txbuf_read].buf;
+		if (TxBuf[txbuf_read].txbuf_state == EMPTY ||
+				(TxBuf[txbuf_read].txbuf_state == FILLED && ! (pt[11] & 0x01) && ! (pt[523] & 0x01) &&
+				ctrl_cmd_count + control_cmd_frames(pt) <= CTRL_CMDS)) {
+			if (TxBuf[txbuf_read].txbuf_state == FILLED)
+				control_lost(pt);
+			TxBuf[txbuf_read].txbuf_state = EMPTY;
+			if (++txbuf_read >= TX_BUF_COUNT)
+				txbuf_read = 0;
+		}
+	}
+	return 0;
+}
+
+static int txbuf_drift_adjust(void)
+// The client sends packets on the PC clock, and they are sent to the HL2 on the HL2 clock.
+// Estimate the clock difference from the trend in the buffer fill, and return an adjustment for
+// txbuf_adjust() that removes or inserts single samples to keep the fill centered at txbuf_used.
+// Call once for each packet sent with HL2_mutex locked.
+{
+	static double fill_avg, window_avg, window_applied, drift, accum;
+	static int ticks;
+	double delta, rate;
+	int fill;
+
+	fill = txbuf_fill(txbuf_read, txbuf_write);
+	if (txbuf_drift_reset) {
+		if (txbuf_drift_reset > 1)
+			drift = drift_ppm = 0;
+		txbuf_drift_reset = 0;
+		fill_avg = window_avg = fill;
+		window_applied = accum = 0;
+		ticks = 0;
+	}
+	fill_avg += (fill - fill_avg) / TX_PACKET_RATE;		// one second time constant
+	if (++ticks >= DRIFT_WINDOW) {
+		// The fill change per packet is the drift less the packets we removed.
+		delta = (fill_avg - window_avg + window_applied) / ticks;
+		drift += (delta - drift) * 0.25;
+		drift_ppm = drift * 1E6;
+		if (DEBUG)
+			printf("Clock drift %.1lf ppm, fill %.1lf\n", drift_ppm, fill_avg);
+		window_avg = fill_avg;
+		window_applied = 0;
+		ticks = 0;
+	}
+	rate = drift + (fill_avg - txbuf_used) / (DRIFT_CENTER * TX_PACKET_RATE);	// packets to remove per packet
+	if (rate > 1.0 / TX_SAMPLES)		// at most one sample in each packet
+		rate = 1.0 / TX_SAMPLES;
+	else if (rate < -1.0 / TX_SAMPLES)
+		rate = -1.0 / TX_SAMPLES;
+	accum += rate * TX_SAMPLES;
+	if (accum >= 1 && fill >= 2) {
+		accum -= 1;
+		window_applied += 1.0 / TX_SAMPLES;
+		drift_removed++;
+		return -1;
+	}
+	if (accum <= -1) {
+		accum += 1;
+		window_applied -= 1.0 / TX_SAMPLES;
+		drift_inserted++;
+		return 1;
+	}
+	return 0;
+}
+
+void txbuf_reset(void)
+// Empty the buffer and clear its statistics for a Start or Stop packet. Call with HL2_mutex locked.
+{
+	int i;
+
+	txbuf_started = STARTUP;
+	txbuf_read = 0;
+	txbuf_write = 0;
+	txbuf_carry_n = 0;
+	txbuf_drift_reset = 2;
+	drift_inserted = drift_removed = 0;
+	keydown_time = 0;
+	wifi_mox = false;
+	ctrl_known = ctrl_pending = 0;
+	ctrl_sent_known = ctrl_lost_bits = 0;
+	ctrl_cmd_count = 0;
+	wifi_seq_duplicate = wifi_seq_out_of_order = wifi_seq_missing = 0;
+	for (i = 0; i < TX_BUF_COUNT; i++)
+		TxBuf[i].txbuf_state = EMPTY;
+	mox = 0;
+	wifi_buffer_overflow = wifi_buffer_underflow = 0;
+}
+
+void txbuf_insert(uint8_t * buffer, double dtime)
+// Save a Tx packet from WiFi in TxBuf at the index given by its sequence number.
+{
+	uint16_t index, above, below;
+	bool late = false;
+
+	index = buffer[6] << 8 | buffer[7];	// 16-bit sequence
+	index &= TX_BUF_MASK;			// index into TxBuf
+	pthread_mutex_lock(&HL2_mutex);
+	if (TX_BUF_EMPTY) {
+		txbuf_read = txbuf_write = index;
+		if (++txbuf_write >= TX_BUF_COUNT) 
+			txbuf_write = 0;
+	}
+	else if (index == txbuf_write) {		// next index is in numerical order
+		if (++txbuf_write >= TX_BUF_COUNT) 
+			txbuf_write = 0;
+	}
+	else {
+		above = txbuf_fill(txbuf_write, index);
+		below = txbuf_fill(index, txbuf_write);
+		if (above < below) {	// index is above txbuf_write
+			if (DEBUG > 1)
+				printf("index above %d %d %d\n", above, txbuf_write, index);
+			txbuf_write = index;
+			if (++txbuf_write >= TX_BUF_COUNT) 
+				txbuf_write = 0;
+		}
+		else {		// index is below txbuf_write
+			wifi_seq_out_of_order++;
+			late = true;
+			if (DEBUG > 1)
+				printf("index below %d %d %d\n", below, txbuf_write, index);
+			above = txbuf_fill(txbuf_read, index);
+			below = txbuf_fill(index, txbuf_read);
+			if (below < above) {	// index is below txbuf_read - discard
+				recorder_event(REC_WIFI, EV_DISCARD, buffer[6] << 8 | buffer[7], 0);
+				pthread_mutex_unlock(&HL2_mutex);
+				return;
+			}
+		}
+	}
+	// copy the received packet in buffer to TxBuf[index]
+	if (TxBuf[index].txbuf_state == FILLED || TxBuf[index].txbuf_state == FILLED_RQST) {
+		if (DEBUG > 1)
+			printf("TxBuf collision at %d\n", index);
+		wifi_seq_duplicate++;
+		recorder_event(REC_WIFI, EV_DUPLICATE, buffer[6] << 8 | buffer[7], 0);
+	}
+	memcpy(TxBuf[index].buf, buffer, TX_BUF_BYTES);
+	if ( ! late) {		// a late packet does not change mox or the C&C registers
+		if (control_fast)
+			control_arrival(buffer, dtime);
+		if (buffer[11] & 0x01) {
+			if ( ! wifi_mox && keydown_time == 0)
+				keydown_time = dtime;
+			wifi_mox = true;
+		}
+		else {
+			wifi_mox = false;
+		}
+	}
+	if (buffer[11] & 0x80 || buffer[523] & 0x80) {	// The RQST bit is set
+		txbuf_send_rqst = index;
+		TxBuf[index].txbuf_state = FILLED_RQST;
+		recorder_event(REC_WIFI, EV_RQST, buffer[6] << 8 | buffer[7], buffer[11] & 0x01);
+	}
+	else {
+		TxBuf[index].txbuf_state = FILLED;
+		recorder_event(REC_WIFI, late ? EV_LATE : EV_INSERT, buffer[6] << 8 | buffer[7], buffer[11] & 0x01);
+	}
+	pthread_mutex_unlock(&HL2_mutex);
+}
+
+void txbuf_check_overflow(void)
+// If the buffer is too full, discard the oldest records. Call with HL2_mutex locked.
+{
+	int i, ignored = 0;
+
+	if (txbuf_fill(txbuf_read, txbuf_write) > txbuf_used * 12 / 10) {	// check for overflow
+		wifi_buffer_overflow++;
+		i = txbuf_read;
+		txbuf_read = txbuf_write - txbuf_used;
+		if (txbuf_read < 0)
+			txbuf_read += TX_BUF_COUNT;
+		while (i != txbuf_read) {	// change ignored records to EMPTY
+			TxBuf[i].txbuf_state = EMPTY;
+			ignored++;
+			if (++i >= TX_BUF_COUNT)
+				i = 0;
+		}
+		if (DEBUG)
+			printf("WiFi TxBuf overflow %d\n", ignored);
+		recorder_event(REC_HL2, EV_OVERFLOW, 0, ignored > 255 ? 255 : ignored);
+		recorder_fault(EV_OVERFLOW);
+	}
+}
+
+uint8_t * txbuf_tick(uint8_t * buffer, double dtime)
+// Return the next packet to send to the HL2. This is called at the HL2 sample rate, one packet
+// for each 126 samples. The buffer is scratch space for a packet with the RQST bit.
+// Call with HL2_mutex locked.
+{
+	uint8_t * ptBuf = &TxBuf[txbuf_last_good].buf[0];
+	int adjust, old_mox;
+
+	if (TX_BUF_EMPTY && txbuf_started == NORMAL) {
+		wifi_buffer_underflow++;
+		if (DEBUG)
+			printf("WiFi TxBuf underflow\n");
+		txbuf_started = RESTARTING;
+		recorder_fault(EV_UNDERFLOW);
+		recorder_event(REC_HL2, EV_STATE, 0, RESTARTING);
+		txbuf_carry_n = 0;
+		if (txbuf_drift_reset == 0)
+			txbuf_drift_reset = 1;
+	}
+	if (txbuf_started == RESTARTING) {		// send the last packet again with zeroed Tx samples
+		if (TxBuf[txbuf_last_good].txbuf_state != ZEROED) {
+			TxBuf[txbuf_last_good].txbuf_state = ZEROED;
+			memset(TxBuf[txbuf_last_good].buf +  16, 0, 504);
+			memset(TxBuf[txbuf_last_good].buf + 528, 0, 504);
+		}
+		if (txbuf_fill(txbuf_read, txbuf_write) >= txbuf_start) {
+			txbuf_started = NORMAL;
+			recorder_event(REC_HL2, EV_STATE, 0, NORMAL);
+			if (DEBUG)
+				printf ("Wifi TxBuf underflow - restarting\n");
+		}
+	}
+	if (txbuf_started == NORMAL) {
+		old_mox = mox;
+		adjust = txbuf_keydown_adjust();
+		if (adjust || (txbuf_keydown && ! mox)) {	// the fill is not at txbuf_used
+			if (txbuf_drift_reset == 0)
+				txbuf_drift_reset = 1;
+		}
+		else if (drift_correct) {
+			adjust = txbuf_drift_adjust();
+		}
+		if (adjust || txbuf_carry_n)
+			ptBuf = txbuf_adjust(adjust);
+		else
+			ptBuf = txbuf_dequeue();
+		if (mox != old_mox)
+			recorder_event(REC_HL2, EV_MOX, 0, mox);
+		if (mox && ! old_mox && keydown_time != 0) {	// record the time to RF
+			keydown_last = dtime - keydown_time;
+			keydown_total += keydown_last;
+			keydown_count++;
+			keydown_time = 0;
+		}
+	}
+	if (txbuf_send_rqst >= 0) {
+		// copy the packet we are sending to the HL2
+		memcpy(buffer, ptBuf, BUFFER_SIZE);
+		// copy C0-C4 to the packet
+		memcpy(buffer +  11, &TxBuf[txbuf_send_rqst].buf[ 11], 5);
+		memcpy(buffer + 523, &TxBuf[txbuf_send_rqst].buf[523], 5);
+		recorder_event(REC_HL2, EV_RQST_SENT, TxBuf[txbuf_send_rqst].buf[6] << 8 | TxBuf[txbuf_send_rqst].buf[7], 0);
+		txbuf_send_rqst = -1;
+		// copy the prevailing mox bit to this out-of-order packet
+		if (mox) {
+			buffer[ 11] |= 0x01;
+			buffer[523] |= 0x01;
+		}
+		else {
+			buffer[ 11] &= 0xFE;
+			buffer[523] &= 0xFE;
+		}
+		ptBuf = buffer;
+	}
+	if (control_fast)
+		control_splice(ptBuf, dtime);
+	control_resend(ptBuf);
+	return ptBuf;
+}
+
@@ -0,0 +1,174 @@
+// This software is Copyright (C) 2023-2024 by James C. Ahlstrom.
+// This free software is licensed for use under the GNU General Public
+// License (GPL), see http://www.opensource.org.
+// Note that there is NO WARRANTY AT ALL.  USE AT YOUR OWN RISK!!
+
+// The Tx buffer, the control fast path and the flight recorder. They are used by hl2_wifi_buffer.c, and by
+// hl2_buffer_sim.c to replay recorded traffic through the same code.
+
+#ifndef TXBUF_H
+#define TXBUF_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define DEBUG	0
+
+#define BUFFER_SIZE	2048
+#define NAME_SIZE	80
+#define TX_BUF_BYTES	1038
+#define TX_BUF_EMPTY	(txbuf_read == txbuf_write)
+
+#define TX_DELAY_MAX	4000	// maximum delay msec from the configuration file
+// The Tx data rate is 48000 sps with 126 I/Q samples per UDP packet, or one UDP packet every 2.625 milliseconds.
+// The buffer space used txbuf_used is delay / 2.625, but can range up to twice this.
+// The buffer size TX_BUF_COUNT must be at least twice this, and must be a power of two.
+// So TX_BUF_COUNT must be at least (TX_DELAY_MAX / 2.625 * 2) * 2.
+#define TX_BUF_BITS	13	// number of address bits
+#define TX_BUF_COUNT	(1 << TX_BUF_BITS)
+#define TX_BUF_MASK	(TX_BUF_COUNT - 1)
+// Each Tx packet has two frames of 63 I/Q samples. Each sample is 8 bytes of L/R audio and I/Q.
+#define TX_SAMPLES	126
+#define TX_SAMPLE_OFFSET(i)	(16 + (i) / 63 * 512 + (i) % 63 * 8)
+
+// Tx packets are sent to the HL2 at 48000 / 126 = 381 packets per second.
+#define TX_PACKET_RATE	(48000.0 / TX_SAMPLES)
+
+// The flight recorder saves buffer events in a ring for each thread. On a fault the rings are frozen and saved.
+#define REC_BITS	12
+#define REC_SIZE	(1 << REC_BITS)	// number of events in each ring
+#define REC_MASK	(REC_SIZE - 1)
+#define REC_AFTER	0.2		// seconds of events to record after a fault
+#define REC_WIFI	0		// ring for the WiFi thread
+#define REC_HL2		1		// ring for the HL2 thread
+
+enum _txbuf_started {
+	STARTUP,
+	NORMAL,
+	RESTARTING
+};
+
+enum _txbuf_state{
+	EMPTY,
+	FILLED,
+	ZEROED,
+	FILLED_RQST
+} ;
+
+enum _rec_event {
+	EV_START,	// Start or Stop packet; arg is byte 3
+	EV_INSERT,	// packet saved in TxBuf
+	EV_LATE,	// out of order packet saved in TxBuf
+	EV_DISCARD,	// out of order packet older than txbuf_read
+	EV_DUPLICATE,	// packet replaced a filled record
+	EV_RQST,	// packet with the RQST bit saved in TxBuf
+	EV_RQST_SENT,	// C0-C4 of a RQST packet sent early
+	EV_DEQUEUE,	// packet sent to the HL2
+	EV_MISSING,	// zeroed packet sent for a missing record
+	EV_ADJUST,	// one sample inserted (arg 1) or removed (arg 255)
+	EV_STATE,	// txbuf_started changed to arg
+	EV_MOX,		// mox sent to the HL2 changed to arg
+	EV_FIFO,	// HL2 Tx FIFO reading is arg
+	EV_UNDERFLOW,
+	EV_OVERFLOW,	// arg is the number of records discarded
+	EV_HL2_FAULT,	// HL2 Tx FIFO error bit was set
+	EV_CONTROL	// changed C&C register arg sent ahead of the samples
+};
+
+struct s_rec_event {	// 16 bytes
+	double time;
+	uint16_t seq;		// 16-bit sequence number of the packet
+	uint16_t fill;		// records in TxBuf
+	uint8_t event;
+	uint8_t arg;
+};
+
+struct s_recorder {	// each ring is written by one thread only, so no lock is needed
+	struct s_rec_event events[REC_SIZE];
+	unsigned int head;	// total number of events written
+};
+
+struct s_txbuf {
+	enum _txbuf_state txbuf_state;
+	uint8_t buf[TX_BUF_BYTES];
+};
+
+// The C0 settings of the last packet sent to the HL2
+extern int mox;
+extern uint8_t num_receivers;
+extern int sample_rate;
+// The Tx buffer. Lock HL2_mutex to change it.
+extern pthread_mutex_t HL2_mutex;
+extern enum _txbuf_started txbuf_started;
+extern struct s_txbuf TxBuf[TX_BUF_COUNT];
+extern int txbuf_read;
+extern int txbuf_write;
+extern int txbuf_send_rqst;
+extern int txbuf_used;
+extern int txbuf_start;
+extern int txbuf_keydown;
+extern int txbuf_last_good;
+// Settings from the configuration file, and statistics
+extern int drift_correct;
+extern double keydown_last;
+extern double keydown_total;
+extern unsigned int keydown_count;
+extern double drift_ppm;
+extern unsigned int drift_inserted;
+extern unsigned int drift_removed;
+extern int control_fast;
+extern unsigned int ctrl_resent;
+extern double ctrl_latency_last;
+extern double ctrl_latency_total;
+extern unsigned int ctrl_count;
+extern unsigned int wifi_buffer_overflow;
+extern unsigned int wifi_buffer_underflow;
+extern uint16_t wifi_seq_duplicate;
+extern uint16_t wifi_seq_out_of_order;
+extern uint16_t wifi_seq_missing;
+// The flight recorder. Lock rec_mutex to read RecSnapshot.
+extern struct s_recorder Recorder[2], RecSnapshot[2];
+extern uint8_t rec_snapshot_event;
+extern double rec_snapshot_time;
+extern unsigned int rec_snapshots;
+extern char recorder_name[NAME_SIZE + 4];
+extern pthread_mutex_t rec_mutex;
+
+double QuiskTimeSec(void);
+void read_C0(uint8_t buffer[]);
+void txbuf_reset(void);
+void txbuf_insert(uint8_t * buffer, double dtime);
+void txbuf_check_overflow(void);
+uint8_t * txbuf_tick(uint8_t * buffer, double dtime);
+void recorder_fault(uint8_t event);
+void recorder_freeze(void);
+void recorder_print(FILE * fp, struct s_recorder rings[], uint8_t fault, double fault_time);
+void * recorder_writer(void * arg);
+
+static inline uint16_t txbuf_fill(uint16_t uMin, uint16_t uMax)
+// Return the number of records in the buffer.
+// Records start at index uMin and continue to index uMax - 1.
+{
+	if (uMax >= uMin)
+		return uMax - uMin;
+	else
+		return TX_BUF_COUNT - uMin + uMax;
+}
+
+static inline void recorder_event(int ring, uint8_t event, uint16_t seq, uint8_t arg)
+// Add an event to the flight recorder ring for this thread.
+{
+	struct s_recorder * rec = Recorder + ring;
+	struct s_rec_event * ev = rec->events + (rec->head & REC_MASK);
+
+	ev->time = QuiskTimeSec();
+	ev->seq = seq;
+	ev->fill = txbuf_fill(txbuf_read, txbuf_write);
+	ev->event = event;
+	ev->arg = arg;
+	__atomic_store_n(&rec->head, rec->head + 1, __ATOMIC_RELEASE);
+}
+
+#endif